@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
@@ -11,6 +12,7 @@
 #define RAM_SIZE 160
 #define RECORD_NUM 10
 #define RECORD_SIZE 4194304
+#define STREAM_BLOCK 65536	// bytes read per read() call in stream mode
 
 /* Global variables */
 pthread_mutex_t   mutex;
@@ -20,6 +22,8 @@ pthread_t *thread;
 int *mem = NULL;
 int sum = 0;
 int itr = RECORD_SIZE / 16;
+int stream = 0;
+long long stream_sum = 0;
 
 void external_calculate(void* arg) {
 	
@@ -57,6 +61,68 @@ void external_calculate(void* arg) {
 }
 
 
+/* stream mode: read binary records in large blocks and sum them into a
+ * per-worker partial, the shared sum is locked once per worker */
+void stream_calculate(void* arg) {
+
+	int k = 0;
+	int n = *((int*) arg);
+	long long partial = 0;
+	int *block = (int*)malloc(STREAM_BLOCK);
+
+	for (k = n; k < RECORD_NUM; k += thread_num) {
+
+		char path[20];
+		sprintf(path, "./record/%d.bin", k);
+
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			printf("failed to open file %s, please run ./genRecord.sh bin first\n", path);
+			exit(0);
+		}
+
+		ssize_t bytes;
+		while ((bytes = read(fd, block, STREAM_BLOCK)) > 0) {
+			int count = bytes / sizeof(int);
+			for (int i = 0; i < count; ++i)
+				partial += block[i];
+		}
+		close(fd);
+	}
+	free(block);
+
+	pthread_mutex_lock(&mutex);
+	stream_sum += partial;
+	pthread_mutex_unlock(&mutex);
+
+	pthread_exit(NULL);
+}
+
+
+/* sum every value of the text records, to check the stream mode */
+long long stream_verify() {
+
+	int k = 0, value = 0;
+	long long total = 0;
+	char path[20];
+
+	for (k = 0; k < RECORD_NUM; ++k) {
+		sprintf(path, "./record/%d", k);
+
+		FILE *f;
+		f = fopen(path, "r");
+		if (!f) {
+			printf("failed to open file %s, please run ./genRecord.sh first\n", path);
+			exit(0);
+		}
+		while (fscanf(f, "%d", &value) == 1)
+			total += value;
+		fclose(f);
+	}
+	return total;
+}
+
+
 void verify() {
 	
 	int i = 0, j = 0, k = 0;
@@ -108,6 +174,8 @@ int main(int argc, char **argv) {
 		} else
 			thread_num = atoi(argv[1]);
 	}
+	if (argc > 2 && strcmp(argv[2], "stream") == 0)
+		stream = 1;
 
 	// initialize counter
 	counter = (int*)malloc(thread_num*sizeof(int));
@@ -125,7 +193,7 @@ int main(int argc, char **argv) {
         clock_gettime(CLOCK_REALTIME, &start);
  
 	for (i = 0; i < thread_num; ++i)
-		pthread_create(&thread[i], NULL, &external_calculate, &counter[i]);
+		pthread_create(&thread[i], NULL, stream ? &stream_calculate : &external_calculate, &counter[i]);
 	
 	signal(SIGABRT, sig_handler);
 	signal(SIGSEGV, sig_handler);
@@ -144,14 +212,18 @@ int main(int argc, char **argv) {
 	pthread_mutex_destroy(&mutex);
 
 	// feel free to verify your answer here:
-	verify();
+	if (stream) {
+		printf("sum is: %lld\n", stream_sum);
+		printf("verified sum is: %lld\n", stream_verify());
+	} else
+		verify();
 	
 	free(mem);
 	free(thread);
 	free(counter);
 
 #ifdef USE_WORKERS
-	fprintf(stderr , "Total sum is: %d\n", sum);
+	fprintf(stderr , "Total sum is: %lld\n", stream ? stream_sum : (long long)sum);
         print_app_stats();
 	fprintf(stderr, "***************************\n");
 #endif
@@ -1,6 +1,21 @@
 #!/bin/bash
+# usage: ./genRecord.sh [bin]
+# "bin" also writes every record as raw 32-bit little-endian integers
+# to ./record/N.bin, read by "./external_cal N stream".
 ITER=0
 COUNTER=0
+BINARY=0
+
+if [ "$1" == "bin" ]; then
+	BINARY=1
+fi
+
+# append VALUE to BUFFER as 4 little-endian bytes, values are below 65535
+put_int() {
+	local BYTES
+	printf -v BYTES '\\x%02x\\x%02x\\x00\\x00' $(( $1 & 255 )) $(( ($1 >> 8) & 255 ))
+	BUFFER+=$BYTES
+}
 
 if [ ! -d "./record" ]; then
 	mkdir record
@@ -8,9 +23,21 @@ fi
 
 while [ $ITER -lt 10 ]; do
 	let "COUNTER=0"
+	if [ $BINARY -eq 1 ]; then
+		# regenerate both files so they hold the same values
+		rm -f ./record/$ITER ./record/$ITER.bin
+		BUFFER=""
+	fi
 	while [ $COUNTER -lt 4096 ]; do
-		echo $(( $RANDOM % 65535)) >> ./record/$ITER
+		VALUE=$(( $RANDOM % 65535))
+		echo $VALUE >> ./record/$ITER
+		if [ $BINARY -eq 1 ]; then
+			put_int $VALUE
+		fi
 		let "COUNTER+=1"
 	done
+	if [ $BINARY -eq 1 ]; then
+		printf "$BUFFER" > ./record/$ITER.bin
+	fi
 	let "ITER+=1"
 done
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include "../thread-worker.h"
@@ -7,6 +8,9 @@
 #define C_SIZE 100000
 #define R_SIZE 10000
 
+/* 4 lanes of unsigned int: wraps like the int sum, and maps to one SSE register */
+typedef unsigned int vec4u __attribute__((vector_size(16)));
+
 pthread_mutex_t   mutex;
 int thread_num;
 int* counter;
@@ -14,6 +18,7 @@ pthread_t *thread;
 int* a[R_SIZE];
 int  pSum[R_SIZE];
 int  sum = 0;
+int  blocked = 0;
 
 
 /* A CPU-bound task to do parallel array addition */
@@ -37,6 +42,41 @@ void parallel_calculate(void* arg) {
 }
 
 
+/* Blocked variant: each thread takes a contiguous range of rows instead of
+ * every thread_num-th row, computes a[j][i] * i 4 lanes at a time into a
+ * private accumulator and adds it to the shared sum under the mutex once. */
+void parallel_calculate_blocked(void* arg) {
+
+	int i = 0, j = 0;
+	int n = *((int*) arg);
+	int rows = (R_SIZE + thread_num - 1) / thread_num;
+	int first = n * rows;
+	int last = first + rows < R_SIZE ? first + rows : R_SIZE;
+	const vec4u step = {4, 4, 4, 4};
+	vec4u acc = {0, 0, 0, 0};
+	unsigned int partial = 0;
+
+	for (j = first; j < last; ++j) {
+		vec4u index = {0, 1, 2, 3};
+		for (i = 0; i + 4 <= C_SIZE; i += 4) {
+			vec4u x;
+			memcpy(&x, &a[j][i], sizeof(x));
+			acc += x * index;
+			index += step;
+		}
+		for (; i < C_SIZE; ++i)
+			partial += (unsigned int)a[j][i] * i;
+	}
+	partial += acc[0] + acc[1] + acc[2] + acc[3];
+
+	pthread_mutex_lock(&mutex);
+	sum += partial;
+	pthread_mutex_unlock(&mutex);
+
+	pthread_exit(NULL);
+}
+
+
 /* verification function */
 void verify() {
 	
@@ -68,6 +108,8 @@ int main(int argc, char **argv) {
 		} else
 			thread_num = atoi(argv[1]);
 	}
+	if (argc > 2 && strcmp(argv[2], "blocked") == 0)
+		blocked = 1;
 
 	// initialize counter
 	counter = (int*)malloc(thread_num*sizeof(int));
@@ -92,7 +134,7 @@ int main(int argc, char **argv) {
 	struct timespec start, end;
         clock_gettime(CLOCK_REALTIME, &start);
 	for (i = 0; i < thread_num; ++i)
-		pthread_create(&thread[i], NULL, &parallel_calculate, &counter[i]);
+		pthread_create(&thread[i], NULL, blocked ? &parallel_calculate_blocked : &parallel_calculate, &counter[i]);
 
 	for (i = 0; i < thread_num; ++i)
 		pthread_join(thread[i], NULL);
@@ -107,6 +149,7 @@ int main(int argc, char **argv) {
 	// mutex destroy
 	pthread_mutex_destroy(&mutex);
 
+	printf("sum is: %d\n", sum);
 	// feel free to verify your answer here:
 	verify();
 	// Free memory on Heap
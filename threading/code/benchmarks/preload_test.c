@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Exercises the pthread calls that the LD_PRELOAD shim maps onto the worker
+ * library. Built against plain pthreads, without thread-worker.h:
+ *
+ *	$ make -C .. SCHED=PSJF shared
+ *	$ LD_PRELOAD=../libthread-worker-preload.so ./preload_test
+ *
+ * Without the shim it runs on glibc threads and should print the same. */
+
+#define DETACHED_THREADS 8
+// a local array larger than the default worker stack
+#define BIG_FRAME (256 * 1024)
+
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+pthread_t self_ids[2];
+int finished = 0;
+int failures = 0;
+
+void check(int ok, const char *what) {
+	printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+	if (!ok)
+		failures++;
+}
+
+/* absolute CLOCK_REALTIME deadline, as the timed calls expect */
+struct timespec deadline_in_ms(long ms) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return ts;
+}
+
+double elapsed_ms(struct timespec start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+void *record_self(void *arg) {
+	self_ids[*(int *)arg] = pthread_self();
+	return NULL;
+}
+
+void *detached_worker(void *arg) {
+	if (arg != NULL)
+		pthread_detach(pthread_self());
+	pthread_mutex_lock(&mutex);
+	finished++;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+void *spin_until_canceled(void *arg) {
+	for (;;)
+		pthread_testcancel();
+	return NULL;
+}
+
+void *use_big_frame(void *arg) {
+	volatile char frame[BIG_FRAME];
+	for (int i = 0; i < BIG_FRAME; i += 4096)
+		frame[i] = 1;
+	return (void *)(long)frame[BIG_FRAME - 4096];
+}
+
+void *hold_mutex(void *arg) {
+	pthread_mutex_lock(&mutex);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// keep the mutex while main times out on it.
+	while (elapsed_ms(start) < 100)
+		sched_yield();
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+void *signal_later(void *arg) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (elapsed_ms(start) < 20)
+		sched_yield();
+	pthread_mutex_lock(&mutex);
+	finished = -1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	pthread_t thread[2];
+	int index[2] = {0, 1};
+	struct timespec deadline, start;
+
+	/* pthread_self / pthread_equal */
+	for (int i = 0; i < 2; i++)
+		pthread_create(&thread[i], NULL, &record_self, &index[i]);
+	for (int i = 0; i < 2; i++)
+		pthread_join(thread[i], NULL);
+	check(pthread_equal(self_ids[0], thread[0]) && pthread_equal(self_ids[1], thread[1]),
+	      "pthread_self matches the id from pthread_create");
+	check(!pthread_equal(self_ids[0], self_ids[1]), "pthread_equal tells threads apart");
+	check(!pthread_equal(pthread_self(), thread[0]), "main is not a created thread");
+
+	/* pthread_detach, by the creator and by the thread itself */
+	for (int i = 0; i < DETACHED_THREADS; i++) {
+		pthread_t detached;
+		pthread_create(&detached, NULL, &detached_worker, i % 2 ? &index[0] : NULL);
+		if (i % 2 == 0)
+			check(pthread_detach(detached) == 0, "pthread_detach from the creator");
+	}
+	/* and through PTHREAD_CREATE_DETACHED */
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (int i = 0; i < DETACHED_THREADS; i++) {
+		pthread_t detached;
+		check(pthread_create(&detached, &attr, &detached_worker, NULL) == 0, "pthread_create with a detached attr");
+	}
+	pthread_attr_destroy(&attr);
+	pthread_mutex_lock(&mutex);
+	deadline = deadline_in_ms(2000);
+	int rc = 0;
+	while (finished < 2 * DETACHED_THREADS && rc == 0)
+		rc = pthread_cond_timedwait(&cond, &mutex, &deadline);
+	check(finished == 2 * DETACHED_THREADS, "every detached thread ran");
+
+	/* pthread_cond_timedwait: time out, then get signaled before the deadline */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = deadline_in_ms(50);
+	rc = pthread_cond_timedwait(&cond, &mutex, &deadline);
+	check(rc == ETIMEDOUT && elapsed_ms(start) >= 45, "pthread_cond_timedwait times out");
+	check(pthread_mutex_trylock(&mutex) != 0, "mutex is held again after the timeout");
+
+	pthread_create(&thread[0], NULL, &signal_later, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = deadline_in_ms(2000);
+	rc = 0;
+	while (finished != -1 && rc == 0)
+		rc = pthread_cond_timedwait(&cond, &mutex, &deadline);
+	check(rc == 0 && finished == -1 && elapsed_ms(start) < 1000, "pthread_cond_timedwait wakes up on a signal");
+	pthread_mutex_unlock(&mutex);
+	pthread_join(thread[0], NULL);
+
+	/* pthread_mutex_timedlock: time out while another thread holds it, then get it */
+	pthread_create(&thread[0], NULL, &hold_mutex, NULL);
+	while (pthread_mutex_trylock(&mutex) == 0) {
+		pthread_mutex_unlock(&mutex);
+		sched_yield();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline = deadline_in_ms(20);
+	check(pthread_mutex_timedlock(&mutex, &deadline) == ETIMEDOUT && elapsed_ms(start) >= 15,
+	      "pthread_mutex_timedlock times out");
+	deadline = deadline_in_ms(2000);
+	check(pthread_mutex_timedlock(&mutex, &deadline) == 0, "pthread_mutex_timedlock gets the mutex");
+	pthread_mutex_unlock(&mutex);
+	pthread_join(thread[0], NULL);
+
+	/* pthread_cancel */
+	void *retval = NULL;
+	pthread_create(&thread[0], NULL, &spin_until_canceled, NULL);
+	check(pthread_cancel(thread[0]) == 0, "pthread_cancel");
+	pthread_join(thread[0], &retval);
+	check(retval == PTHREAD_CANCELED, "a canceled thread returns PTHREAD_CANCELED");
+
+	/* pthread_attr_setstacksize */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 2 * BIG_FRAME);
+	check(pthread_create(&thread[0], &attr, &use_big_frame, NULL) == 0, "pthread_create with a stack size");
+	pthread_join(thread[0], &retval);
+	check(retval == (void *)1, "the thread has the stack size it asked for");
+	pthread_attr_destroy(&attr);
+
+	/* calls the shim cannot do fail instead of handing a worker id to glibc */
+	char name[16];
+	rc = pthread_getname_np(pthread_self(), name, sizeof(name));
+	check(rc == 0 || rc == ENOSYS, "pthread_getname_np");
+	pthread_attr_t self_attr;
+	rc = pthread_getattr_np(pthread_self(), &self_attr);
+	if (rc == 0)
+		pthread_attr_destroy(&self_attr);
+	check(rc == 0 || rc == ENOSYS, "pthread_getattr_np");
+
+	printf("%s\n", failures == 0 ? "all checks passed" : "some checks failed");
+	return failures != 0;
+}
@@ -1,10 +1,15 @@
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include "../thread-worker.h"
 
 #define DEFAULT_THREAD_NUM 2
 #define VECTOR_SIZE 3000000
+#define BLOCK_SIZE 4096	// elements per block, r and s blocks together fill 32KB of L1
+
+/* 4 lanes of unsigned int: wraps like the int sum, and maps to one SSE register */
+typedef unsigned int vec4u __attribute__((vector_size(16)));
 
 /* Global variables */
 pthread_mutex_t   mutex;
@@ -14,6 +19,7 @@ pthread_t *thread;
 int r[VECTOR_SIZE];
 int s[VECTOR_SIZE];
 int sum = 0;
+int blocked = 0;
 
 /* A CPU-bound task to do vector multiplication */
 void vector_multiply(void* arg) {
@@ -29,6 +35,35 @@ void vector_multiply(void* arg) {
 	pthread_exit(NULL);
 }
 
+/* Blocked variant: each thread owns every thread_num-th block of BLOCK_SIZE
+ * elements, multiplies it 4 lanes at a time into a private accumulator
+ * and adds its partial to the shared sum under the mutex once. */
+void vector_multiply_blocked(void* arg) {
+	int i = 0, b = 0;
+	int n = *((int*) arg);
+	vec4u acc = {0, 0, 0, 0};
+	unsigned int partial = 0;
+
+	for (b = n * BLOCK_SIZE; b < VECTOR_SIZE; b += thread_num * BLOCK_SIZE) {
+		int end = b + BLOCK_SIZE < VECTOR_SIZE ? b + BLOCK_SIZE : VECTOR_SIZE;
+		for (i = b; i + 4 <= end; i += 4) {
+			vec4u x, y;
+			memcpy(&x, &r[i], sizeof(x));
+			memcpy(&y, &s[i], sizeof(y));
+			acc += x * y;
+		}
+		for (; i < end; ++i)
+			partial += (unsigned int)r[i] * s[i];
+	}
+	partial += acc[0] + acc[1] + acc[2] + acc[3];
+
+	pthread_mutex_lock(&mutex);
+	sum += partial;
+	pthread_mutex_unlock(&mutex);
+
+	pthread_exit(NULL);
+}
+
 void verify() {
 	int i = 0;
 	sum = 0;
@@ -52,6 +87,8 @@ int main(int argc, char **argv) {
 			thread_num = atoi(argv[1]);
 		}
 	}
+	if (argc > 2 && strcmp(argv[2], "blocked") == 0)
+		blocked = 1;
 
 	// initialize counter
 	counter = (int*)malloc(thread_num*sizeof(int));
@@ -73,7 +110,7 @@ int main(int argc, char **argv) {
         clock_gettime(CLOCK_REALTIME, &start);
 
 	for (i = 0; i < thread_num; ++i)
-		pthread_create(&thread[i], NULL, &vector_multiply, &counter[i]);
+		pthread_create(&thread[i], NULL, blocked ? &vector_multiply_blocked : &vector_multiply, &counter[i]);
 
 	for (i = 0; i < thread_num; ++i)
 		pthread_join(thread[i], NULL);
@@ -86,6 +123,7 @@ int main(int argc, char **argv) {
                (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
 
 	pthread_mutex_destroy(&mutex);
+	printf("sum is: %d\n", sum);
 	verify();
 
 	// Free memory on Heap
@@ -0,0 +1,354 @@
+// File:	pthread-shim.c
+//
+// Interposes the pthread thread, mutex and condition variable calls with
+// the worker library, so that unmodified binaries can run on the user-level
+// scheduler:
+//
+//     LD_PRELOAD=./libthread-worker-preload.so ./prebuilt-binary
+//
+// pthread_mutex_t and pthread_cond_t objects are reused as storage for
+// worker_mutex_t and worker_cond_t. PTHREAD_*_INITIALIZER zero-fills them,
+// which the worker library treats as an unlocked mutex / empty wait list.
+//
+// Every call that takes or returns a pthread_t, pthread_mutex_t or
+// pthread_cond_t must be defined here: glibc would read the worker ids and
+// objects as its own structures. What the worker library cannot do fails
+// with ENOSYS instead.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include "thread-worker.h"
+
+// the shim defines the real pthread symbols, not the renamed ones.
+#undef pthread_t
+#undef pthread_mutex_t
+#undef pthread_create
+#undef pthread_exit
+#undef pthread_join
+#undef pthread_detach
+#undef pthread_self
+#undef pthread_equal
+#undef pthread_cancel
+#undef pthread_mutex_init
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+#undef pthread_mutex_destroy
+#undef pthread_mutex_trylock
+#undef pthread_mutex_timedlock
+#undef pthread_cond_t
+#undef pthread_cond_init
+#undef pthread_cond_wait
+#undef pthread_cond_timedwait
+#undef pthread_cond_signal
+#undef pthread_cond_broadcast
+#undef pthread_cond_destroy
+
+_Static_assert(sizeof(worker_mutex_t) <= sizeof(pthread_mutex_t), "worker_mutex_t must fit in pthread_mutex_t");
+_Static_assert(sizeof(worker_cond_t) <= sizeof(pthread_cond_t), "worker_cond_t must fit in pthread_cond_t");
+
+__attribute__((constructor)) static void shim_init()
+{
+    // make the main thread a worker before the program can take a mutex.
+    if (!_init_worker_library())
+    {
+        perror("Failed to initialize the worker library");
+        exit(1);
+    }
+}
+
+/* attributes worker_create cannot honor: a stack of the caller's, explicit scheduling */
+static int unsupported_attr(const pthread_attr_t *attr)
+{
+    void *stack_addr;
+    size_t stack_size;
+    int inherit_sched;
+    if (attr == NULL)
+    {
+        return 0;
+    }
+    // without pthread_attr_setstack the reported low end is 0 - stack_size.
+    if (pthread_attr_getstack(attr, &stack_addr, &stack_size) == 0 && (uintptr_t)stack_addr + stack_size != 0)
+    {
+        return ENOTSUP;
+    }
+    if (pthread_attr_getinheritsched(attr, &inherit_sched) == 0 && inherit_sched == PTHREAD_EXPLICIT_SCHED)
+    {
+        return ENOTSUP;
+    }
+    // worker stacks never had guard pages, the guard size is not checked.
+    return 0;
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine)(void *), void *arg)
+{
+    worker_t worker_thread_id = 0;
+    int attr_status = unsupported_attr(attr);
+    if (attr_status != 0)
+    {
+        return attr_status;
+    }
+    // worker_create takes the stack size and detach state from attr.
+    if (!worker_create(&worker_thread_id, (pthread_attr_t *)attr, start_routine, arg))
+    {
+        return EAGAIN;
+    }
+    *thread = worker_thread_id;
+    return 0;
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    return worker_join((worker_t)thread, retval) ? 0 : ESRCH;
+}
+
+int pthread_detach(pthread_t thread)
+{
+    return worker_detach((worker_t)thread) ? 0 : EINVAL;
+}
+
+pthread_t pthread_self(void)
+{
+    return worker_self();
+}
+
+int pthread_equal(pthread_t t1, pthread_t t2)
+{
+    return t1 == t2;
+}
+
+int pthread_cancel(pthread_t thread)
+{
+    return worker_cancel((worker_t)thread) ? 0 : ESRCH;
+}
+
+void pthread_testcancel(void)
+{
+    worker_testcancel();
+}
+
+int sched_yield(void)
+{
+    // every worker shares one kernel thread, yield to the other workers.
+    worker_yield();
+    return 0;
+}
+
+static int invalid_deadline(const struct timespec *abstime)
+{
+    return abstime == NULL || abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000;
+}
+
+/* abstime on clock_id as the CLOCK_REALTIME deadline the worker timed waits take */
+static int realtime_deadline(clockid_t clock_id, const struct timespec *abstime, struct timespec *deadline)
+{
+    if (invalid_deadline(abstime) || (clock_id != CLOCK_REALTIME && clock_id != CLOCK_MONOTONIC))
+    {
+        return EINVAL;
+    }
+    *deadline = *abstime;
+    if (clock_id == CLOCK_MONOTONIC)
+    {
+        struct timespec monotonic_now, realtime_now;
+        clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+        clock_gettime(CLOCK_REALTIME, &realtime_now);
+        long long deadline_ns = (realtime_now.tv_sec + abstime->tv_sec - monotonic_now.tv_sec) * 1000000000LL +
+                                realtime_now.tv_nsec + abstime->tv_nsec - monotonic_now.tv_nsec;
+        deadline->tv_sec = deadline_ns / 1000000000;
+        deadline->tv_nsec = deadline_ns % 1000000000;
+    }
+    return 0;
+}
+
+void pthread_exit(void *retval)
+{
+    worker_exit(retval);
+    // a finished worker is never switched back to.
+    exit(0);
+}
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr)
+{
+    return worker_mutex_init((worker_mutex_t *)mutex, attr) ? 0 : EINVAL;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    return worker_mutex_lock((worker_mutex_t *)mutex) ? 0 : EINVAL;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    return worker_mutex_trylock((worker_mutex_t *)mutex) ? 0 : EBUSY;
+}
+
+int pthread_mutex_timedlock(pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+    if (((worker_mutex_t *)mutex)->pshared)
+    {
+        // process-shared mutexes wait on a futex, which has no deadline here.
+        return ENOSYS;
+    }
+    if (worker_mutex_trylock((worker_mutex_t *)mutex))
+    {
+        return 0;
+    }
+    if (invalid_deadline(abstime))
+    {
+        return EINVAL;
+    }
+    return worker_mutex_timedlock((worker_mutex_t *)mutex, abstime) ? 0 : ETIMEDOUT;
+}
+
+int pthread_mutex_clocklock(pthread_mutex_t *mutex, clockid_t clock_id, const struct timespec *abstime)
+{
+    struct timespec deadline;
+    int status = realtime_deadline(clock_id, abstime, &deadline);
+    return status != 0 ? status : pthread_mutex_timedlock(mutex, &deadline);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    return worker_mutex_unlock((worker_mutex_t *)mutex) ? 0 : EPERM;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    return worker_mutex_destroy((worker_mutex_t *)mutex) ? 0 : EBUSY;
+}
+
+int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr)
+{
+    return worker_cond_init((worker_cond_t *)cond, attr) ? 0 : EINVAL;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    return worker_cond_wait((worker_cond_t *)cond, (worker_mutex_t *)mutex) ? 0 : EPERM;
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime)
+{
+    if (invalid_deadline(abstime))
+    {
+        return EINVAL;
+    }
+    if (((worker_mutex_t *)mutex)->owner != getCurrentThread())
+    {
+        return EPERM;
+    }
+    return worker_cond_timedwait((worker_cond_t *)cond, (worker_mutex_t *)mutex, abstime) ? 0 : ETIMEDOUT;
+}
+
+int pthread_cond_clockwait(pthread_cond_t *cond, pthread_mutex_t *mutex, clockid_t clock_id, const struct timespec *abstime)
+{
+    struct timespec deadline;
+    int status = realtime_deadline(clock_id, abstime, &deadline);
+    return status != 0 ? status : pthread_cond_timedwait(cond, mutex, &deadline);
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    return worker_cond_signal((worker_cond_t *)cond) ? 0 : EINVAL;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    return worker_cond_broadcast((worker_cond_t *)cond) ? 0 : EINVAL;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    return worker_cond_destroy((worker_cond_t *)cond) ? 0 : EBUSY;
+}
+
+// Calls on a worker id or worker object that the worker library has no
+// counterpart for. glibc must not see them, so they fail here.
+
+int pthread_kill(pthread_t thread, int sig)
+{
+    return ENOSYS;
+}
+
+int pthread_sigqueue(pthread_t thread, int sig, const union sigval value)
+{
+    return ENOSYS;
+}
+
+int pthread_tryjoin_np(pthread_t thread, void **retval)
+{
+    return ENOSYS;
+}
+
+int pthread_timedjoin_np(pthread_t thread, void **retval, const struct timespec *abstime)
+{
+    return ENOSYS;
+}
+
+int pthread_clockjoin_np(pthread_t thread, void **retval, clockid_t clock_id, const struct timespec *abstime)
+{
+    return ENOSYS;
+}
+
+int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr)
+{
+    return ENOSYS;
+}
+
+int pthread_setname_np(pthread_t thread, const char *name)
+{
+    return ENOSYS;
+}
+
+int pthread_getname_np(pthread_t thread, char *name, size_t len)
+{
+    return ENOSYS;
+}
+
+int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param *param)
+{
+    return ENOSYS;
+}
+
+int pthread_getschedparam(pthread_t thread, int *policy, struct sched_param *param)
+{
+    return ENOSYS;
+}
+
+int pthread_setschedprio(pthread_t thread, int prio)
+{
+    return ENOSYS;
+}
+
+int pthread_setaffinity_np(pthread_t thread, size_t cpusetsize, const cpu_set_t *cpuset)
+{
+    return ENOSYS;
+}
+
+int pthread_getaffinity_np(pthread_t thread, size_t cpusetsize, cpu_set_t *cpuset)
+{
+    return ENOSYS;
+}
+
+int pthread_getcpuclockid(pthread_t thread, clockid_t *clock_id)
+{
+    return ENOSYS;
+}
+
+int pthread_mutex_consistent(pthread_mutex_t *mutex)
+{
+    return ENOSYS;
+}
+
+int pthread_mutex_getprioceiling(const pthread_mutex_t *mutex, int *prioceiling)
+{
+    return ENOSYS;
+}
+
+int pthread_mutex_setprioceiling(pthread_mutex_t *mutex, int prioceiling, int *old_ceiling)
+{
+    return ENOSYS;
+}
@@ -84,6 +84,38 @@ void* front(queue_t *q)
     return q->front->data;
 }
 
+// Function to unlink the first node holding value, returns 1 if it was found
+int remove_item(queue_t *q, void *value)
+{
+    node_t *prev = NULL;
+    node_t *current = q->front;
+
+    while (current != NULL && current->data != value)
+    {
+        prev = current;
+        current = current->next;
+    }
+    if (current == NULL)
+    {
+        return 0;
+    }
+
+    if (prev == NULL)
+    {
+        q->front = current->next;
+    }
+    else
+    {
+        prev->next = current->next;
+    }
+    if (q->rear == current)
+    {
+        q->rear = prev;
+    }
+    free(current);
+    return 1;
+}
+
 // Function to free the queue and its nodes
 void destroy_queue(queue_t *q)
 {
@@ -21,6 +21,7 @@ void enqueue(queue_t *q, void *value);
 void *dequeue(queue_t *q);
 int is_empty(queue_t *q);
 void *front(queue_t *q);
+int remove_item(queue_t *q, void *value);
 void destroy_queue(queue_t *q);
 
 #endif
\ No newline at end of file
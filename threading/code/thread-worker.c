@@ -3,8 +3,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/futex.h>
 #include "thread-worker.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(COOP) && defined(_FORTIFY_SOURCE) && _FORTIFY_SOURCE > 0
+// the fortified _longjmp aborts when it jumps to another makecontext stack.
+#error "the COOP build must be compiled with -U_FORTIFY_SOURCE, see COOP_FLAGS in the Makefile"
+#endif
 
 // Global counter for total context switches and
 // average turn around and response time
@@ -19,6 +33,11 @@ tcb *schedular_thread = NULL;
 
 queue_t *thread_queue = NULL;
 
+// threads parked in worker_join / worker_sleep / worker_wait_fd
+queue_t *join_list = NULL;
+queue_t *sleep_list = NULL;
+queue_t *io_list = NULL;
+
 int firstTimeWorkerThread = 1;
 tcb *thread_table[MAX_THREADS];
 
@@ -27,33 +46,49 @@ int thread_id_counter = MAIN_THREAD_ID + SCHEDULAR_THREAD_ID + 1;
 /* Find the TCB for the specified thread ID */
 tcb *find_tcb(worker_t thread_id)
 {
-    if (thread_id >= MAX_THREADS)
+    // thread ids keep growing, slots are reused once a thread is joined.
+    tcb *thread_tcb = thread_table[thread_id % MAX_THREADS];
+    if (thread_tcb == NULL || thread_tcb->thread_id != thread_id)
     {
         return NULL;
     }
-    return thread_table[thread_id];
+    return thread_tcb;
 }
 
 /* Add a new thread to the thread table */
 void add_thread_to_thread_table(worker_t thread_id, tcb *tcb)
 {
-    if (thread_id >= MAX_THREADS)
-    {
-        return;
-    }
-    thread_table[thread_id] = tcb;
+    thread_table[thread_id % MAX_THREADS] = tcb;
 }
 
 /* Remove a thread from the thread table */
 void remove_thread_from_thread_table(worker_t thread_id)
 {
-    if (thread_id >= MAX_THREADS)
+    if (find_tcb(thread_id) == NULL)
     {
         return;
     }
-    thread_table[thread_id] = NULL;
+    thread_table[thread_id % MAX_THREADS] = NULL;
+}
+
+/* Hand out the next thread ID whose thread table slot is free */
+int next_thread_id(worker_t *thread_id)
+{
+    for (int i = 0; i < MAX_THREADS; i++)
+    {
+        worker_t candidate = thread_id_counter++;
+        if (thread_table[candidate % MAX_THREADS] == NULL)
+        {
+            *thread_id = candidate;
+            return 1;
+        }
+    }
+    return ERROR_CODE; // MAX_THREADS threads are alive
 }
 
+static int yield_to_schedular();
+static int make_thread_context(tcb *thread_tcb, void *(*function)(void *), void *arg, void *stack);
+
 int safe_malloc(void **ptr, size_t size)
 {
     if (ptr == NULL)
@@ -76,13 +111,34 @@ double compute_milliseconds(struct timespec start)
     return (seconds_to_nanoseconds + nanoseconds) / 1000000;
 }
 
+unsigned long long read_cycle_counter()
+{
+    /**
+     * Cheap per-switch timestamp without a syscall.
+     * x86: time stamp counter, arm64: virtual counter,
+     * elsewhere fall back to the monotonic clock in nanoseconds.
+     */
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    unsigned long long cycles;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(cycles));
+    return cycles;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
 void fall_back_to_schedular(int signum)
 {
     if (DEBUG)
     {
         printf("fall back to scheduler\n");
     }
-    if (worker_yield() < 1)
+    // preemption is not a cancellation point, so skip worker_testcancel.
+    if (yield_to_schedular() < 1)
     {
         // handle error
         perror("Failed to swap context with worker thread.");
@@ -100,6 +156,10 @@ void create_thread_timer()
     {
         printf("Create thread timer\n");
     }
+#ifdef COOP
+    // cooperative build: threads only leave the CPU by yielding or blocking.
+    return;
+#endif
     struct sigaction sa;
 
     memset(&sa, 0, sizeof(sa));
@@ -125,32 +185,50 @@ void create_thread_timer()
 
 void wrapper_worker_function(void *(*function)(void *), void *arg)
 {
+    // canceled before it ever ran.
+    worker_testcancel();
     worker_exit(function(arg));
 };
 
-int _create_thread(tcb **thread_tcb_pointer, worker_t *thread_id)
+static void init_tcb(tcb *thread_tcb, worker_t thread_id)
 {
     /**
-     * Create the actual TCB on heap space.
      * Set thread status to READY.
      * Set thread ID.
      */
-    if (!safe_malloc((void **)thread_tcb_pointer, sizeof(tcb)))
-    {
-        return ERROR_CODE;
-    }
-    tcb *thread_tcb = *thread_tcb_pointer;
-
     Threads_state ts = THREAD_READY;
     thread_tcb->status = ts;
 
+    clock_gettime(CLOCK_MONOTONIC, &thread_tcb->timer_start);
+    thread_tcb->thread_id = thread_id; // thread-id
+    thread_tcb->stack = NULL;
+    thread_tcb->stack_size = STACK_SIZE;
+    thread_tcb->run_already = 0;
+    // the main thread is already running when its TCB is made, its first burst starts here.
+    thread_tcb->burst_start = read_cycle_counter();
+    thread_tcb->cpu_cycles = 0;
+    thread_tcb->predicted_burst = 0; // new threads look short, so they get a first run quickly
+    thread_tcb->switched_out = thread_tcb->burst_start;
+    thread_tcb->context_started = 0;
+    thread_tcb->cancel_requested = 0;
+    thread_tcb->detached = 0;
+    thread_tcb->batch = NULL;
+}
+
+int _create_thread(tcb **thread_tcb_pointer, worker_t *thread_id)
+{
+    /**
+     * Create the actual TCB on heap space.
+     */
     if (thread_id == NULL)
     {
         return ERROR_CODE;
     }
-    clock_gettime(CLOCK_MONOTONIC, &thread_tcb->timer_start);
-    thread_tcb->thread_id = *thread_id; // thread-id
-    thread_tcb->run_already = 0;
+    if (!safe_malloc((void **)thread_tcb_pointer, sizeof(tcb)))
+    {
+        return ERROR_CODE;
+    }
+    init_tcb(*thread_tcb_pointer, *thread_id);
     return 1;
 };
 
@@ -171,18 +249,25 @@ int _create_thread_context(tcb *thread_tcb, void *(*function)(void *), void *arg
      * Create the thread stack.
      * Set stack attribute.
      */
-    if (!_populate_thread_context(thread_tcb))
+    void *stack;
+    if (!safe_malloc(&stack, thread_tcb->stack_size))
     {
         return ERROR_CODE;
     }
-    thread_tcb->context.uc_link = NULL;
+    return make_thread_context(thread_tcb, function, arg, stack);
+};
 
-    if (!safe_malloc((void **)&(thread_tcb->context.uc_stack.ss_sp), STACK_SIZE))
+static int make_thread_context(tcb *thread_tcb, void *(*function)(void *), void *arg, void *stack)
+{
+    if (!_populate_thread_context(thread_tcb))
     {
         return ERROR_CODE;
     }
+    thread_tcb->context.uc_link = NULL;
 
-    thread_tcb->context.uc_stack.ss_size = STACK_SIZE;
+    thread_tcb->stack = stack;
+    thread_tcb->context.uc_stack.ss_sp = stack;
+    thread_tcb->context.uc_stack.ss_size = thread_tcb->stack_size;
     thread_tcb->context.uc_stack.ss_flags = 0;
 
     // number of arguements
@@ -197,6 +282,129 @@ int _create_thread_context(tcb *thread_tcb, void *(*function)(void *), void *arg
     return 1;
 };
 
+int _switch_context(tcb *from, tcb *to)
+{
+    /**
+     * Save the running context into from and resume to.
+     * Returns once some other thread switches back to from.
+     *
+     * Every switch away from a worker ends one CPU burst: charge the cycles
+     * it actually ran and fold them into its burst prediction
+     * (exponential average: next = a * last + (1 - a) * previous).
+     */
+    unsigned long long now = read_cycle_counter();
+    if (from != getSchedularThread())
+    {
+        unsigned long long burst = now - from->burst_start;
+        from->cpu_cycles += burst;
+        from->predicted_burst = BURST_ALPHA * burst + (1 - BURST_ALPHA) * from->predicted_burst;
+        from->switched_out = now;
+    }
+    to->burst_start = now;
+
+    tot_cntx_switches++;
+#ifdef COOP
+    /**
+     * No timer signal can interrupt a cooperative build, so there is no signal
+     * mask to save and restore. _setjmp/_longjmp switch stacks without the
+     * sigprocmask system call that swapcontext makes on every switch.
+     * A thread's first run still enters its makecontext context through setcontext.
+     */
+    if (_setjmp(from->jump_buffer) == 0)
+    {
+        if (to->context_started)
+        {
+            _longjmp(to->jump_buffer, 1);
+        }
+        to->context_started = 1;
+        setcontext(&to->context);
+        return ERROR_CODE; // setcontext only returns on failure
+    }
+    return 1;
+#else
+    return swapcontext(&from->context, &to->context) >= 0;
+#endif
+}
+
+int _init_worker_library()
+{
+    /**
+     * We have 2 thread contexts created on first use.
+     * Main thread (its context is filled in by the first switch away from it)
+     * Schedular thread
+     *
+     * Setup the timer to switch back to the schedular function
+     * Setup the queue to store the active threads
+     */
+    if (!firstTimeWorkerThread)
+    {
+        return 1;
+    }
+    tcb *main_thread;
+    worker_t main_thread_id = MAIN_THREAD_ID;
+    if (!_create_thread(&main_thread, &main_thread_id))
+    {
+        return ERROR_CODE;
+    }
+    // main thread context is set by getcontext
+    main_thread->context_started = 1;
+    setCurrentThread(main_thread);
+
+    add_thread_to_thread_table(main_thread_id, main_thread);
+
+    // thread schedular config.
+    tcb *schedular_thread;
+    worker_t schedular_thread_id = SCHEDULAR_THREAD_ID;
+    if (!_create_thread(&schedular_thread, &schedular_thread_id))
+    {
+        return ERROR_CODE;
+    }
+    // create thread context for worker thread.
+    if (!_create_thread_context(schedular_thread, schedule_entry_point, NULL))
+    {
+        return ERROR_CODE;
+    }
+    setSchedularThread(schedular_thread);
+    add_thread_to_thread_table(schedular_thread_id, schedular_thread);
+
+    // create thread runqueue, wakeup source lists and timer
+    queue_t *q = create_queue();
+    setThreadQueue(q);
+    join_list = create_queue();
+    sleep_list = create_queue();
+    io_list = create_queue();
+    create_thread_timer();
+
+    firstTimeWorkerThread = 0;
+    return 1;
+}
+
+/* stack size set in attr, STACK_SIZE if attr is NULL or leaves it at the default */
+static size_t thread_stack_size(const pthread_attr_t *attr)
+{
+    size_t stack_size, default_size;
+    pthread_attr_t defaults;
+    if (attr == NULL || pthread_attr_getstacksize(attr, &stack_size) != 0)
+    {
+        return STACK_SIZE;
+    }
+    pthread_attr_init(&defaults);
+    pthread_attr_getstacksize(&defaults, &default_size);
+    pthread_attr_destroy(&defaults);
+    return stack_size == default_size ? STACK_SIZE : stack_size;
+}
+
+/* stack size and detach state of a new thread, before its context is made */
+static void apply_thread_attr(tcb *thread_tcb, const pthread_attr_t *attr)
+{
+    int detach_state;
+    thread_tcb->stack_size = thread_stack_size(attr);
+    if (attr != NULL && pthread_attr_getdetachstate(attr, &detach_state) == 0)
+    {
+        thread_tcb->detached = detach_state == PTHREAD_CREATE_DETACHED;
+    }
+}
+
 /* create a new thread */
 int worker_create(worker_t *worker_thread_id, pthread_attr_t *attr,
                   void *(*function)(void *), void *arg)
@@ -217,50 +425,23 @@ int worker_create(worker_t *worker_thread_id, pthread_attr_t *attr,
      */
 
     // first time init only
-    if (firstTimeWorkerThread)
+    if (firstTimeWorkerThread && !_init_worker_library())
     {
-        tcb *main_thread;
-        worker_t main_thread_id = MAIN_THREAD_ID;
-        if (!_create_thread(&main_thread, &main_thread_id))
-        {
-            return ERROR_CODE;
-        }
-        // main thread context is set by getcontext
-        setCurrentThread(main_thread);
-
-        add_thread_to_thread_table(main_thread_id, main_thread);
-
-        // thread schedular config.
-        tcb *schedular_thread;
-        worker_t schedular_thread_id = SCHEDULAR_THREAD_ID;
-        if (!_create_thread(&schedular_thread, &schedular_thread_id))
-        {
-            return ERROR_CODE;
-        }
-        // create thread context for worker thread.
-        if (!_create_thread_context(schedular_thread, schedule_entry_point, NULL))
-        {
-            return ERROR_CODE;
-        }
-        setSchedularThread(schedular_thread);
-        add_thread_to_thread_table(schedular_thread_id, schedular_thread);
-
-        // create thread runqueue and timer
-        queue_t *q = create_queue();
-        setThreadQueue(q);
-        create_thread_timer();
-
-        firstTimeWorkerThread = 0;
+        return ERROR_CODE;
     }
 
     // worker thread
     // worker cannot have main thread or schedular thread id.
-    *worker_thread_id += thread_id_counter;
+    if (!next_thread_id(worker_thread_id))
+    {
+        return ERROR_CODE;
+    }
     tcb *worker_thread;
     if (!_create_thread(&worker_thread, worker_thread_id))
     {
         return ERROR_CODE;
     }
+    apply_thread_attr(worker_thread, attr);
     if (!_create_thread_context(worker_thread, function, arg))
     {
         return ERROR_CODE;
@@ -270,12 +451,78 @@ int worker_create(worker_t *worker_thread_id, pthread_attr_t *attr,
     // enqueue worker thread.
     enqueue(getThreadQueue(), worker_thread);
 
-    thread_id_counter++;
     return worker_thread->thread_id;
 };
 
+/* create a batch of worker threads with a single allocation */
+int worker_create_n(worker_t *threads, int num_threads, pthread_attr_t *attr,
+                    void *(*function)(void *), void **args)
+{
+    /**
+     * Thread i runs function(args[i]), or function(NULL) if args is NULL.
+     *
+     * One allocation holds the batch header, every TCB and every stack.
+     * The batch is freed when its last thread is joined.
+     * The run queue is only touched once every thread is set up.
+     */
+    if (threads == NULL || num_threads < 1)
+    {
+        return ERROR_CODE;
+    }
+    if (firstTimeWorkerThread && !_init_worker_library())
+    {
+        return ERROR_CODE;
+    }
+
+    // keep TCBs and stacks 16 byte aligned.
+    size_t header_size = (sizeof(worker_batch) + 15) & ~(size_t)15;
+    size_t tcb_size = (sizeof(tcb) + 15) & ~(size_t)15;
+    size_t stack_size = (thread_stack_size(attr) + 15) & ~(size_t)15;
+    char *block;
+    if (!safe_malloc((void **)&block, header_size + num_threads * (tcb_size + stack_size)))
+    {
+        return ERROR_CODE;
+    }
+    worker_batch *batch = (worker_batch *)block;
+    batch->live_threads = num_threads;
+    tcb *batch_tcbs = (tcb *)(block + header_size);
+    char *batch_stacks = block + header_size + num_threads * tcb_size;
+
+    for (int i = 0; i < num_threads; i++)
+    {
+        tcb *worker_thread = (tcb *)((char *)batch_tcbs + i * tcb_size);
+        if (!next_thread_id(&threads[i]))
+        {
+            // undo the threads added so far.
+            while (--i >= 0)
+            {
+                remove_thread_from_thread_table(threads[i]);
+            }
+            free(block);
+            return ERROR_CODE;
+        }
+        init_tcb(worker_thread, threads[i]);
+        worker_thread->batch = batch;
+        apply_thread_attr(worker_thread, attr);
+        make_thread_context(worker_thread, function, args == NULL ? NULL : args[i], batch_stacks + i * stack_size);
+        add_thread_to_thread_table(threads[i], worker_thread);
+    }
+    for (int i = 0; i < num_threads; i++)
+    {
+        enqueue(getThreadQueue(), (char *)batch_tcbs + i * tcb_size);
+    }
+    return 1;
+};
+
 /* give CPU possession to other user-level worker threads voluntarily */
 int worker_yield()
+{
+    // voluntary yields are cancellation points.
+    worker_testcancel();
+    return yield_to_schedular();
+};
+
+static int yield_to_schedular()
 {
     /**
      * There should be a current thread.
@@ -302,7 +549,7 @@ int worker_yield()
     tcb *current_thread = getCurrentThread();
     tcb *schedular_thread = getSchedularThread();
 
-    if (!thread_finished(current_thread))
+    if (!thread_finished(current_thread) && current_thread->status != THREAD_BLOCKED)
     {
         current_thread->status = THREAD_READY; // interuppted there
     }
@@ -312,8 +559,7 @@ int worker_yield()
     {
         printf("Before swap context to schedular Current thread ID: %d status: %d\n", getCurrentThread()->thread_id, getCurrentThread()->status);
     }
-    tot_cntx_switches++;
-    if (swapcontext(&(current_thread->context), &(schedular_thread->context)) < 0)
+    if (!_switch_context(current_thread, schedular_thread))
     {
         perror("Cannot exec anymore\n");
         return ERROR_CODE;
@@ -325,6 +571,76 @@ int worker_yield()
     return 1;
 };
 
+/* give CPU possession directly to a ready worker thread */
+int worker_yield_to(worker_t thread)
+{
+    /**
+     * Switch straight to the target thread without going through the scheduler.
+     *
+     * The target is unlinked from the run queue and the current thread takes its
+     * place at the back. The quantum timer is not reset, so the target runs for
+     * whatever is left of the current thread's quantum.
+     *
+     * If the target is not ready to run, fall back to a regular yield.
+     */
+    tcb *current_thread = getCurrentThread();
+    tcb *target_thread = find_tcb(thread);
+    if (current_thread == NULL || target_thread == NULL || target_thread == current_thread ||
+        target_thread->status != THREAD_READY || !remove_item(getThreadQueue(), target_thread))
+    {
+        return worker_yield();
+    }
+
+    current_thread->status = THREAD_READY;
+    enqueue(getThreadQueue(), current_thread);
+
+    target_thread->status = THREAD_RUNNING;
+    if (!target_thread->run_already)
+    {
+        avg_resp_time = compute_milliseconds(target_thread->timer_start);
+        target_thread->run_already = 1;
+    }
+    setCurrentThread(target_thread);
+    if (!_switch_context(current_thread, target_thread))
+    {
+        perror("Cannot exec anymore\n");
+        return ERROR_CODE;
+    }
+    return 1;
+};
+
+/* request deferred cancellation of a thread */
+int worker_cancel(worker_t thread)
+{
+    /**
+     * The thread exits with WORKER_CANCELED at its next cancellation point:
+     * worker_yield, a mutex or join wait, worker_sleep, worker_wait_fd or a
+     * channel operation. A parked thread is woken up so it gets there.
+     */
+    tcb *thread_tcb = find_tcb(thread);
+    if (thread_tcb == NULL || thread == MAIN_THREAD_ID || thread == SCHEDULAR_THREAD_ID)
+    {
+        return ERROR_CODE;
+    }
+    if (thread_finished(thread_tcb))
+    {
+        return 1;
+    }
+    thread_tcb->cancel_requested = 1;
+    _wake_thread(thread_tcb);
+    return 1;
+};
+
+/* exit the current thread if its cancellation was requested */
+void worker_testcancel()
+{
+    tcb *current_thread = getCurrentThread();
+    if (current_thread != NULL && current_thread->cancel_requested)
+    {
+        worker_exit(WORKER_CANCELED);
+    }
+};
+
 /* terminate a thread */
 void worker_exit(void *value_ptr)
 {
@@ -332,9 +648,9 @@ void worker_exit(void *value_ptr)
 
     current_thread->ret_val = value_ptr;
     current_thread->status = THREAD_FINISHED;
+    _wake_all_threads(join_list);
 
-    tot_cntx_switches++;
-    swapcontext(&current_thread->context, &getSchedularThread()->context);
+    _switch_context(current_thread, getSchedularThread());
 };
 
 tcb *get_main_thread()
@@ -347,15 +663,106 @@ int thread_finished(tcb *thread)
     return thread->status == THREAD_FINISHED;
 }
 
+void _park_current_thread()
+{
+    /**
+     * Take the current thread off the CPU without putting it back on
+     * the run queue. Whoever parked it is responsible for remembering it
+     * and calling _wake_thread later.
+     */
+    getCurrentThread()->status = THREAD_BLOCKED;
+    yield_to_schedular();
+}
+
+int _wake_thread(tcb *thread)
+{
+    /**
+     * Move a parked thread back to the run queue.
+     * Returns 0 if the thread was not parked.
+     */
+    if (thread->status != THREAD_BLOCKED)
+    {
+        return 0;
+    }
+    thread->status = THREAD_READY;
+    enqueue(getThreadQueue(), thread);
+    return 1;
+}
+
+void _block_current_thread(queue_t *wait_list)
+{
+    /**
+     * Park the current thread on a wait list.
+     * The scheduler will not run it again until some other thread
+     * moves it back to the run queue with _wake_one_thread/_wake_all_threads.
+     *
+     * This is a cancellation point: worker_cancel wakes the thread up and
+     * it leaves the wait list and exits here.
+     */
+    tcb *current_thread = getCurrentThread();
+    worker_testcancel();
+    enqueue(wait_list, current_thread);
+    _park_current_thread();
+    if (current_thread->cancel_requested)
+    {
+        remove_item(wait_list, current_thread);
+        worker_exit(WORKER_CANCELED);
+    }
+}
+
+int _wake_one_thread(queue_t *wait_list)
+{
+    /**
+     * Move the first blocked thread of the wait list to the run queue.
+     * Returns 1 if a thread was woken up, otherwise 0.
+     */
+    while (!is_empty(wait_list))
+    {
+        if (_wake_thread(dequeue(wait_list)))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void _wake_all_threads(queue_t *wait_list)
+{
+    while (_wake_one_thread(wait_list))
+        ;
+}
+
+/* drop a finished thread from the thread table and free its TCB and stack */
+static void free_finished_thread(tcb *thread_tcb)
+{
+    avg_turn_time = compute_milliseconds(thread_tcb->timer_start);
+    remove_thread_from_thread_table(thread_tcb->thread_id);
+
+    if (thread_tcb->batch != NULL)
+    {
+        // TCB and stack belong to a worker_create_n allocation.
+        worker_batch *batch = thread_tcb->batch;
+        if (--batch->live_threads == 0)
+        {
+            free(batch);
+        }
+        return;
+    }
+    free(thread_tcb->stack);
+    free(thread_tcb);
+}
+
 /* Wait for thread termination */
 int worker_join(worker_t thread, void **value_ptr)
 {
     /* Wait for thread termination */
     tcb *thread_tcb;
 
+    worker_testcancel();
+
     // Find the TCB for the specified thread ID
     thread_tcb = find_tcb(thread);
-    if (thread_tcb == NULL)
+    if (thread_tcb == NULL || thread_tcb->detached)
     {
         return ERROR_CODE;
     }
@@ -371,45 +778,345 @@ int worker_join(worker_t thread, void **value_ptr)
             {
                 printf("Switching to other worker threads for processing\n");
             }
-            worker_yield();
+            // park until some thread exits instead of polling.
+            _block_current_thread(join_list);
         }
     }
     if (value_ptr != NULL)
     {
         *value_ptr = thread_tcb->ret_val;
     }
-    avg_turn_time = compute_milliseconds(thread_tcb->timer_start);
+    free_finished_thread(thread_tcb);
+    return 1;
+};
 
-    if (&thread_tcb->context.uc_stack != NULL)
+/* let the scheduler free the thread when it finishes */
+int worker_detach(worker_t thread)
+{
+    tcb *thread_tcb = find_tcb(thread);
+    if (thread_tcb == NULL || thread_tcb->detached || thread == MAIN_THREAD_ID || thread == SCHEDULAR_THREAD_ID)
+    {
+        return ERROR_CODE;
+    }
+    if (thread_finished(thread_tcb))
     {
-        free(thread_tcb->context.uc_stack.ss_sp);
+        free_finished_thread(thread_tcb);
+        return 1;
     }
-    free(thread_tcb);
+    thread_tcb->detached = 1;
     return 1;
 };
 
-/* initialize the mutex lock */
-int worker_mutex_init(worker_mutex_t *mutex,
-                      const pthread_mutexattr_t *mutexattr)
+/* id of the calling thread */
+worker_t worker_self()
 {
-    if (mutex == NULL)
+    if (firstTimeWorkerThread)
     {
-        perror("Mutex is not initialized.\n");
-        exit(1);
+        _init_worker_library();
     }
-    mutex->locked = 0;                  // Indicates that mutex is unlocked initially. 0 for unlocked, 1 for locked.
-    mutex->owner = NULL;                // No owner yet because it's unlocked
-    mutex->block_list = create_queue(); // A queue to manage threads waiting for this mutex
-    return 1;
+    return getCurrentThread()->thread_id;
 };
 
-/* aquire the mutex lock */
-int worker_mutex_lock(worker_mutex_t *mutex)
+/* deadline of the sleep list, delay_ns from now */
+static void set_wake_time(tcb *thread, long long delay_ns)
 {
-    if (mutex == NULL)
+    if (delay_ns < 0)
     {
-        perror("Mutex is not initialized.\n");
-        exit(1);
+        delay_ns = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &thread->wake_time);
+    thread->wake_time.tv_sec += delay_ns / 1000000000;
+    thread->wake_time.tv_nsec += delay_ns % 1000000000;
+    if (thread->wake_time.tv_nsec >= 1000000000)
+    {
+        thread->wake_time.tv_sec++;
+        thread->wake_time.tv_nsec -= 1000000000;
+    }
+}
+
+/* time left until a CLOCK_REALTIME deadline, as pthread timed waits take it */
+static long long nanoseconds_until(const struct timespec *abstime)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (long long)(abstime->tv_sec - now.tv_sec) * 1000000000 + (abstime->tv_nsec - now.tv_nsec);
+}
+
+/* park the current thread for at least the given number of milliseconds */
+int worker_sleep(unsigned int milliseconds)
+{
+    if (firstTimeWorkerThread && !_init_worker_library())
+    {
+        return ERROR_CODE;
+    }
+    set_wake_time(getCurrentThread(), (long long)milliseconds * 1000000);
+    _block_current_thread(sleep_list);
+    return 1;
+}
+
+/* park the current thread until fd is ready for the given poll events */
+int worker_wait_fd(int fd, short events)
+{
+    if (firstTimeWorkerThread && !_init_worker_library())
+    {
+        return ERROR_CODE;
+    }
+    tcb *current_thread = getCurrentThread();
+    current_thread->wait_fd = fd;
+    current_thread->wait_events = events;
+    _block_current_thread(io_list);
+    return 1;
+}
+
+/* process-shared mutex support */
+static pid_t cached_tid = 0;
+
+static void reset_cached_tid()
+{
+    cached_tid = syscall(SYS_gettid);
+}
+
+static pid_t current_tid()
+{
+    // every worker of a process runs on the same kernel thread.
+    // gettid is a system call; cache it and refresh it in forked children.
+    if (cached_tid == 0)
+    {
+        cached_tid = syscall(SYS_gettid);
+        pthread_atfork(NULL, NULL, reset_cached_tid);
+    }
+    return cached_tid;
+}
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/*
+ * Robust futex list of this process' kernel thread, which links the shared
+ * mutexes it holds. glibc registers one per kernel thread for its own robust
+ * mutexes, and there is a single slot, so the shared mutexes are linked into
+ * that list. Ours is only registered when the thread has none.
+ * NULL if the shared mutexes cannot be linked in: they are then not robust.
+ */
+static struct robust_list_head *robust_head = NULL;
+static pid_t robust_head_tid = 0;
+
+// registered when the kernel thread has no robust list, with the prev link glibc's lists have.
+static struct
+{
+    void *prev;
+    struct robust_list_head head;
+} own_robust_list;
+
+_Static_assert(offsetof(worker_mutex_t, robust_node) == offsetof(worker_mutex_t, robust_prev) + sizeof(void *),
+               "robust_prev must come right before robust_node");
+
+/*
+ * glibc keeps its robust list doubly linked: the prev link sits in the word
+ * before each node, the head included. Both links point at the next field of
+ * a node, bit 0 marks a priority inheritance mutex.
+ */
+static void **robust_prev_link(struct robust_list *node)
+{
+    return (void **)((uintptr_t)node & ~1UL) - 1;
+}
+
+static void register_robust_list(pid_t tid)
+{
+    /**
+     * When a thread exits, the kernel walks its robust list. Every futex
+     * still owned by it gets FUTEX_OWNER_DIED and a waiter is woken up.
+     * The list has one futex_offset for every node, which the layout of
+     * worker_mutex_t matches with glibc's pthread_mutex_t.
+     * A forked child has a new tid, and glibc gives it an empty list.
+     */
+    if (robust_head_tid == tid)
+    {
+        return;
+    }
+    robust_head_tid = tid;
+    long futex_offset = offsetof(worker_mutex_t, locked) - offsetof(worker_mutex_t, robust_node);
+    struct robust_list_head *head = NULL;
+    size_t head_size;
+    if (syscall(SYS_get_robust_list, 0, &head, &head_size) == 0 && head != NULL)
+    {
+        robust_head = head->futex_offset == futex_offset ? head : NULL;
+        return;
+    }
+    own_robust_list.prev = &own_robust_list.head.list;
+    own_robust_list.head.list.next = &own_robust_list.head.list;
+    own_robust_list.head.futex_offset = futex_offset;
+    own_robust_list.head.list_op_pending = NULL;
+    int registered = syscall(SYS_set_robust_list, &own_robust_list.head, sizeof(own_robust_list.head)) == 0;
+    robust_head = registered ? &own_robust_list.head : NULL;
+}
+
+/* the node the kernel finishes if the thread dies while the list is changed */
+static void robust_list_pending(struct robust_list *node)
+{
+    if (robust_head != NULL)
+    {
+        robust_head->list_op_pending = node;
+    }
+}
+
+static void robust_list_remove(worker_mutex_t *mutex)
+{
+    if (robust_head == NULL)
+    {
+        return;
+    }
+    struct robust_list *next = mutex->robust_node.next;
+    *robust_prev_link(next) = mutex->robust_prev;
+    ((struct robust_list *)((uintptr_t)mutex->robust_prev & ~1UL))->next = next;
+}
+
+/* take the lock word if it has no owner: unlocked, or its owner died */
+static int take_shared_mutex(worker_mutex_t *mutex, pid_t tid, int waiters)
+{
+    int word = mutex->locked;
+    return (word & FUTEX_TID_MASK) == 0 &&
+           __sync_bool_compare_and_swap(&mutex->locked, word, tid | waiters | (word & FUTEX_WAITERS));
+}
+
+static void shared_mutex_acquired(worker_mutex_t *mutex)
+{
+    if (robust_head != NULL)
+    {
+        // link in at the head, as glibc does.
+        struct robust_list *first = robust_head->list.next;
+        *robust_prev_link(first) = &mutex->robust_node;
+        mutex->robust_node.next = first;
+        mutex->robust_prev = &robust_head->list;
+        robust_head->list.next = &mutex->robust_node;
+    }
+    robust_list_pending(NULL);
+    mutex->owner = getCurrentThread();
+}
+
+static int lock_shared_mutex(worker_mutex_t *mutex)
+{
+    /**
+     * The lock word doubles as the futex word, in the kernel's robust futex
+     * format: 0 unlocked, otherwise the tid of the owning process' kernel
+     * thread, with FUTEX_WAITERS set once somebody may be sleeping on it.
+     *
+     * - fast path: compare-and-swap 0 -> tid, same cost as the in-process mutex.
+     * - spin a bounded number of times, the holder may be running on another core.
+     * - if the holder is a worker of this process, it can only release the lock
+     *   once we yield, so yield instead of blocking the carrier.
+     * - otherwise park the whole process in FUTEX_WAIT until the holder unlocks.
+     *   There is no timeout: if the holder dies, the kernel clears its tid
+     *   through the robust list and wakes us, and we take the lock over.
+     */
+    pid_t tid = current_tid();
+    register_robust_list(tid);
+    // covers a death between taking the word and linking the node.
+    robust_list_pending(&mutex->robust_node);
+    if (take_shared_mutex(mutex, tid, 0))
+    {
+        goto acquired;
+    }
+    for (int i = 0; i < SHARED_MUTEX_SPINS; i++)
+    {
+        cpu_relax();
+        if (take_shared_mutex(mutex, tid, 0))
+        {
+            goto acquired;
+        }
+    }
+    while (1)
+    {
+        // after sleeping we cannot know whether others still sleep, so keep FUTEX_WAITERS set.
+        if (take_shared_mutex(mutex, tid, FUTEX_WAITERS))
+        {
+            goto acquired;
+        }
+        int word = mutex->locked;
+        if ((word & FUTEX_TID_MASK) == 0)
+        {
+            continue;
+        }
+        if ((word & FUTEX_TID_MASK) == tid && getCurrentThread() != NULL)
+        {
+            worker_yield();
+            continue;
+        }
+        if (!(word & FUTEX_WAITERS) && !__sync_bool_compare_and_swap(&mutex->locked, word, word | FUTEX_WAITERS))
+        {
+            continue;
+        }
+        syscall(SYS_futex, &mutex->locked, FUTEX_WAIT, word | FUTEX_WAITERS, NULL, NULL, 0);
+        if (getCurrentThread() != NULL)
+        {
+            // the process slept in the kernel, that is not part of the CPU burst.
+            getCurrentThread()->burst_start = read_cycle_counter();
+        }
+    }
+acquired:
+    shared_mutex_acquired(mutex);
+    return 1;
+}
+
+static int unlock_shared_mutex(worker_mutex_t *mutex)
+{
+    if ((mutex->locked & FUTEX_TID_MASK) != current_tid() || mutex->owner != getCurrentThread())
+    {
+        return ERROR_CODE;
+    }
+    mutex->owner = NULL;
+    robust_list_pending(&mutex->robust_node);
+    robust_list_remove(mutex);
+    // only enter the kernel if somebody may be sleeping on the futex.
+    if (__atomic_exchange_n(&mutex->locked, 0, __ATOMIC_RELEASE) & FUTEX_WAITERS)
+    {
+        syscall(SYS_futex, &mutex->locked, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    robust_list_pending(NULL);
+    return 1;
+}
+
+/* initialize the mutex lock */
+int worker_mutex_init(worker_mutex_t *mutex,
+                      const pthread_mutexattr_t *mutexattr)
+{
+    if (mutex == NULL)
+    {
+        perror("Mutex is not initialized.\n");
+        exit(1);
+    }
+    int pshared = PTHREAD_PROCESS_PRIVATE;
+    if (mutexattr != NULL)
+    {
+        pthread_mutexattr_getpshared(mutexattr, &pshared);
+    }
+    mutex->locked = 0;   // Indicates that mutex is unlocked initially. 0 for unlocked, 1 for locked.
+    mutex->owner = NULL; // No owner yet because it's unlocked
+    mutex->robust_node.next = NULL;
+    mutex->robust_prev = NULL;
+    mutex->pshared = pshared == PTHREAD_PROCESS_SHARED;
+    // A queue to manage threads waiting for this mutex.
+    // Heap pointers mean nothing to other processes, a shared mutex waits on the futex instead.
+    mutex->block_list = mutex->pshared ? NULL : create_queue();
+    return 1;
+};
+
+/* aquire the mutex lock */
+int worker_mutex_lock(worker_mutex_t *mutex)
+{
+    if (mutex == NULL)
+    {
+        perror("Mutex is not initialized.\n");
+        exit(1);
+    }
+
+    if (mutex->pshared)
+    {
+        return lock_shared_mutex(mutex);
     }
 
     // - use the built-in test-and-set atomic function to test the mutex
@@ -427,11 +1134,14 @@ int worker_mutex_lock(worker_mutex_t *mutex)
         {
             printf("Thread that is blocked: %d\n", getCurrentThread()->thread_id);
         }
-        getCurrentThread()->status = THREAD_BLOCKED;
+        // a statically initialized (zeroed) mutex gets its block list on first contention.
+        if (mutex->block_list == NULL)
+        {
+            mutex->block_list = create_queue();
+        }
         // Mutex has been locked, we will add the current thread to the list of threads waiting for unlock
-        enqueue(mutex->block_list, getCurrentThread());
-        // Context switch to the scheduler to run other threads
-        worker_yield(); // This should save the current state and switch to scheduler context
+        // and context switch to the scheduler to run other threads
+        _block_current_thread(mutex->block_list);
     }
 
     if (DEBUG)
@@ -457,6 +1167,11 @@ int worker_mutex_unlock(worker_mutex_t *mutex)
         exit(1);
     }
 
+    if (mutex->pshared)
+    {
+        return unlock_shared_mutex(mutex);
+    }
+
     if (mutex->owner != getCurrentThread())
     {
         // The current thread is trying to unlock a mutex it doesn't own
@@ -468,16 +1183,11 @@ int worker_mutex_unlock(worker_mutex_t *mutex)
     __sync_lock_release(&mutex->locked); // Unlock mutex by setting to 0
 
     // If there are threads waiting for this mutex, time to wake them up
-    if (!is_empty(mutex->block_list))
+    // Move all threads from block list to run queue, they're ready to run
+    // so that they could compete for mutex later.
+    if (mutex->block_list != NULL)
     {
-        // Move all threads from block list to run queue, they're ready to run
-        while (!is_empty(mutex->block_list))
-        {
-            // Add the thread to the ready queue, so scheduler can run it
-            tcb *next_thread = dequeue(mutex->block_list);
-            next_thread->status = THREAD_RUNNING;
-            enqueue(getThreadQueue(), next_thread);
-        }
+        _wake_all_threads(mutex->block_list);
     }
 
     return 1;
@@ -498,7 +1208,219 @@ int worker_mutex_destroy(worker_mutex_t *mutex)
         return ERROR_CODE;
     }
 
-    destroy_queue(mutex->block_list);
+    if (mutex->block_list != NULL)
+    {
+        destroy_queue(mutex->block_list);
+        mutex->block_list = NULL;
+    }
+    return 1;
+};
+
+/* aquire the mutex lock only if it is free */
+int worker_mutex_trylock(worker_mutex_t *mutex)
+{
+    if (mutex == NULL)
+    {
+        perror("Mutex is not initialized.\n");
+        exit(1);
+    }
+    if (mutex->pshared)
+    {
+        pid_t tid = current_tid();
+        register_robust_list(tid);
+        robust_list_pending(&mutex->robust_node);
+        if (!take_shared_mutex(mutex, tid, 0))
+        {
+            robust_list_pending(NULL);
+            return ERROR_CODE;
+        }
+        shared_mutex_acquired(mutex);
+        return 1;
+    }
+    else if (__sync_lock_test_and_set(&mutex->locked, 1))
+    {
+        return ERROR_CODE;
+    }
+    mutex->owner = getCurrentThread();
+    return 1;
+};
+
+/* aquire the mutex lock, giving up once the deadline passed */
+int worker_mutex_timedlock(worker_mutex_t *mutex, const struct timespec *abstime)
+{
+    /**
+     * Wait on the block list and the sleep list at the same time: an unlock
+     * or the deadline, whichever comes first, moves the thread back to the
+     * run queue, and it is then unlinked from the other list.
+     * Not supported for process-shared mutexes.
+     */
+    if (mutex == NULL)
+    {
+        perror("Mutex is not initialized.\n");
+        exit(1);
+    }
+    if (mutex->pshared)
+    {
+        return ERROR_CODE;
+    }
+    tcb *current_thread = getCurrentThread();
+    while (__sync_lock_test_and_set(&mutex->locked, 1))
+    {
+        if (mutex->block_list == NULL)
+        {
+            mutex->block_list = create_queue();
+        }
+        worker_testcancel();
+        set_wake_time(current_thread, nanoseconds_until(abstime));
+        enqueue(mutex->block_list, current_thread);
+        enqueue(sleep_list, current_thread);
+        _park_current_thread();
+        // still on the block list: the deadline or worker_cancel woke us up, not an unlock.
+        int timed_out = remove_item(mutex->block_list, current_thread);
+        remove_item(sleep_list, current_thread);
+        worker_testcancel();
+        if (timed_out)
+        {
+            // the lock may have been released right at the deadline.
+            if (!__sync_lock_test_and_set(&mutex->locked, 1))
+            {
+                break;
+            }
+            return ERROR_CODE;
+        }
+    }
+    mutex->owner = current_thread;
+    return 1;
+};
+
+/* initialize the condition variable */
+int worker_cond_init(worker_cond_t *cond, const pthread_condattr_t *condattr)
+{
+    if (cond == NULL)
+    {
+        perror("Condition variable is not initialized.\n");
+        exit(1);
+    }
+    cond->wait_list = create_queue();
+    return 1;
+};
+
+/* release the mutex, wait for a signal and re-aquire the mutex */
+int worker_cond_wait(worker_cond_t *cond, worker_mutex_t *mutex)
+{
+    /**
+     * Join the wait list before releasing the mutex, so a signal sent
+     * right after the unlock cannot be missed.
+     */
+    if (cond == NULL || mutex == NULL)
+    {
+        perror("Condition variable is not initialized.\n");
+        exit(1);
+    }
+    if (cond->wait_list == NULL)
+    {
+        cond->wait_list = create_queue();
+    }
+    enqueue(cond->wait_list, getCurrentThread());
+    if (!worker_mutex_unlock(mutex))
+    {
+        remove_item(cond->wait_list, getCurrentThread());
+        return ERROR_CODE;
+    }
+    _park_current_thread();
+    if (getCurrentThread()->cancel_requested)
+    {
+        // woken by worker_cancel rather than a signal.
+        remove_item(cond->wait_list, getCurrentThread());
+    }
+    return worker_mutex_lock(mutex);
+};
+
+/* like worker_cond_wait, but also wakes up once the deadline passed */
+int worker_cond_timedwait(worker_cond_t *cond, worker_mutex_t *mutex, const struct timespec *abstime)
+{
+    /**
+     * Wait on the condition's wait list and the sleep list at the same time,
+     * see worker_mutex_timedlock. The mutex is held again on return,
+     * also when the wait timed out (return 0).
+     */
+    if (cond == NULL || mutex == NULL)
+    {
+        perror("Condition variable is not initialized.\n");
+        exit(1);
+    }
+    if (cond->wait_list == NULL)
+    {
+        cond->wait_list = create_queue();
+    }
+    tcb *current_thread = getCurrentThread();
+    enqueue(cond->wait_list, current_thread);
+    if (!worker_mutex_unlock(mutex))
+    {
+        remove_item(cond->wait_list, current_thread);
+        return ERROR_CODE;
+    }
+    set_wake_time(current_thread, nanoseconds_until(abstime));
+    enqueue(sleep_list, current_thread);
+    _park_current_thread();
+    // still on the wait list: the deadline or worker_cancel woke us up, not a signal.
+    int timed_out = remove_item(cond->wait_list, current_thread);
+    remove_item(sleep_list, current_thread);
+    if (!worker_mutex_lock(mutex))
+    {
+        return ERROR_CODE;
+    }
+    return !timed_out;
+};
+
+/* wake one thread waiting on the condition variable */
+int worker_cond_signal(worker_cond_t *cond)
+{
+    if (cond == NULL)
+    {
+        perror("Condition variable is not initialized.\n");
+        exit(1);
+    }
+    if (cond->wait_list != NULL)
+    {
+        _wake_one_thread(cond->wait_list);
+    }
+    return 1;
+};
+
+/* wake every thread waiting on the condition variable */
+int worker_cond_broadcast(worker_cond_t *cond)
+{
+    if (cond == NULL)
+    {
+        perror("Condition variable is not initialized.\n");
+        exit(1);
+    }
+    if (cond->wait_list != NULL)
+    {
+        _wake_all_threads(cond->wait_list);
+    }
+    return 1;
+};
+
+/* destroy the condition variable */
+int worker_cond_destroy(worker_cond_t *cond)
+{
+    if (cond == NULL)
+    {
+        perror("Condition variable is not initialized.\n");
+        exit(1);
+    }
+    if (cond->wait_list != NULL)
+    {
+        // threads are still waiting on it.
+        if (!is_empty(cond->wait_list))
+        {
+            return ERROR_CODE;
+        }
+        destroy_queue(cond->wait_list);
+        cond->wait_list = NULL;
+    }
     return 1;
 };
 
@@ -521,6 +1443,128 @@ static void schedule()
 #endif
 }
 
+static int wake_up_sources(int idle)
+{
+    /**
+     * Move sleepers whose deadline passed and fd waiters whose fd is ready
+     * back to the run queue.
+     *
+     * When idle (nothing runnable), block the process in poll() until the
+     * earliest sleeper deadline, an fd event, or a signal.
+     * Returns 0 if nothing could ever wake a thread up (deadlock).
+     */
+    do
+    {
+        if (is_empty(sleep_list) && is_empty(io_list))
+        {
+            return !idle;
+        }
+
+        int timeout = idle ? -1 : 0;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (node_t *node = sleep_list->front; node != NULL;)
+        {
+            tcb *thread = node->data;
+            node = node->next;
+
+            double remaining = (thread->wake_time.tv_sec - now.tv_sec) * 1000.0 +
+                               (thread->wake_time.tv_nsec - now.tv_nsec) / 1000000.0;
+            if (remaining <= 0)
+            {
+                remove_item(sleep_list, thread);
+                _wake_thread(thread);
+                idle = 0;
+            }
+            else if (timeout < 0 || remaining < timeout)
+            {
+                timeout = (int)remaining + 1;
+            }
+        }
+        if (!idle)
+        {
+            timeout = 0;
+        }
+        if (is_empty(io_list) && timeout == 0)
+        {
+            return 1;
+        }
+
+        int num_fds = 0;
+        for (node_t *node = io_list->front; node != NULL; node = node->next)
+        {
+            num_fds++;
+        }
+        struct pollfd *fds = NULL;
+        if (num_fds > 0 && !safe_malloc((void **)&fds, num_fds * sizeof(struct pollfd)))
+        {
+            return 1;
+        }
+        int i = 0;
+        for (node_t *node = io_list->front; node != NULL; node = node->next, i++)
+        {
+            tcb *thread = node->data;
+            fds[i].fd = thread->wait_fd;
+            fds[i].events = thread->wait_events;
+            fds[i].revents = 0;
+        }
+
+        if (DEBUG && idle)
+        {
+            printf("Scheduler idle for %d ms\n", timeout);
+        }
+        int ready = poll(fds, num_fds, timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("Scheduler failed to poll wakeup sources");
+        }
+
+        i = 0;
+        for (node_t *node = io_list->front; node != NULL && ready > 0; i++)
+        {
+            tcb *thread = node->data;
+            node = node->next;
+            if (fds[i].revents != 0)
+            {
+                remove_item(io_list, thread);
+                _wake_thread(thread);
+            }
+        }
+        free(fds);
+        // a signal or timeout ends the poll, re-check the sleepers.
+        idle = is_empty(getThreadQueue());
+    } while (idle);
+    return 1;
+}
+
+static tcb *dequeue_shortest_job(queue_t *q)
+{
+    /**
+     * Run queue is unordered; pick the thread with the shortest predicted burst.
+     *
+     * Aging: the comparison takes BURST_AGING cycles off a prediction for
+     * every cycle the thread has been off the CPU, so a long job waits at
+     * most about predicted_burst / BURST_AGING even when short jobs keep
+     * yielding. The prediction itself is left alone, and the credit starts
+     * over once the thread runs.
+     */
+    unsigned long long now = read_cycle_counter();
+    tcb *shortest = NULL;
+    double shortest_burst = 0;
+    for (node_t *node = q->front; node != NULL; node = node->next)
+    {
+        tcb *thread = node->data;
+        double aged_burst = thread->predicted_burst - BURST_AGING * (double)(now - thread->switched_out);
+        if (shortest == NULL || aged_burst < shortest_burst)
+        {
+            shortest = thread;
+            shortest_burst = aged_burst;
+        }
+    }
+    remove_item(q, shortest);
+    return shortest;
+}
+
 /* Pre-emptive Shortest Job First (POLICY_PSJF) scheduling algorithm */
 static int sched_psjf(queue_t *q)
 {
@@ -530,6 +1574,12 @@ static int sched_psjf(queue_t *q)
     }
     while (1)
     {
+        if (getCurrentThread() != NULL && thread_finished(getCurrentThread()) && getCurrentThread()->detached)
+        {
+            // nobody joins a detached thread, and it is off its own stack now.
+            free_finished_thread(getCurrentThread());
+            setCurrentThread(NULL);
+        }
         if (getCurrentThread() != NULL && !thread_finished(getCurrentThread()) && getCurrentThread()->status != THREAD_BLOCKED)
         {
             if (DEBUG)
@@ -543,7 +1593,8 @@ static int sched_psjf(queue_t *q)
         {
             printf("Finding next thread to schedule\n");
         }
-        if (is_empty(q))
+        // wake sleepers and fd waiters; sleep in the kernel if nothing is runnable.
+        if (!wake_up_sources(is_empty(q)) || is_empty(q))
         {
             perror("Main thread exited unexpectedly! Killing main process.");
             exit(1); // completely destroys process
@@ -551,7 +1602,7 @@ static int sched_psjf(queue_t *q)
         // worker thread exec.
         if (!is_empty(q))
         {
-            tcb *thread_to_run = dequeue(q);
+            tcb *thread_to_run = dequeue_shortest_job(q);
             thread_to_run->status = THREAD_RUNNING;
             if (!thread_to_run->run_already)
             {
@@ -568,8 +1619,7 @@ static int sched_psjf(queue_t *q)
             {
                 printf("Swapping context to thread id: %d\n", getCurrentThread()->thread_id);
             }
-            tot_cntx_switches++;
-            if (swapcontext(&getSchedularThread()->context, &getCurrentThread()->context) < 0)
+            if (!_switch_context(getSchedularThread(), getCurrentThread()))
             {
                 perror("Swap context failed\n");
                 return ERROR_CODE;
@@ -579,6 +1629,14 @@ static int sched_psjf(queue_t *q)
     return 1;
 }
 
+/* Function to print global statistics. Do not modify this function.*/
+void print_app_stats(void)
+{
+    fprintf(stderr, "Total context switches %ld \n", tot_cntx_switches);
+    fprintf(stderr, "Average turnaround time %lf \n", avg_turn_time);
+    fprintf(stderr, "Average response time  %lf \n", avg_resp_time);
+}
+
 void setCurrentThread(tcb *thread_exec)
 {
     current_thread = thread_exec;
@@ -11,8 +11,19 @@
 
 #define ERROR_CODE 0
 
+// return value of a thread that exited through worker_cancel
+#define WORKER_CANCELED ((void *)-1)
+
 #define QUANTUM 10 // 10ms
 
+// weight of the last CPU burst in the PSJF burst prediction
+#define BURST_ALPHA 0.5
+// process-shared mutex: user space spins before waiting on the futex
+#define SHARED_MUTEX_SPINS 100
+
+// PSJF aging: cycles taken off a ready thread's prediction per cycle it has been waiting
+#define BURST_AGING 0.0625
+
 #define DEBUG 0
 
 #include <unistd.h>
@@ -21,8 +32,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ucontext.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <time.h>
+#include <linux/futex.h>
 #include "queue.h"
 
 typedef unsigned int worker_t;
@@ -44,14 +57,33 @@ typedef struct TCB
 	worker_t thread_id;
 	ucontext_t context;
 	void *stack;
+	size_t stack_size; // bytes at stack, from the pthread_attr_t given to worker_create
 	Threads_state status;
 	int priority;
 	void *ret_val;
 	int time_running;
 	struct timespec timer_start;
 	int run_already;
+	struct timespec wake_time; // deadline while parked in worker_sleep
+	int wait_fd;			   // fd and poll events while parked in worker_wait_fd
+	short wait_events;
+	unsigned long long burst_start; // cycle counter when the thread was last switched in
+	unsigned long long cpu_cycles;	// cycles the thread actually ran
+	double predicted_burst;			// exponentially weighted average of past bursts, in cycles
+	unsigned long long switched_out; // cycle counter when the thread last stopped running
+	jmp_buf jump_buffer;			// saved registers for the COOP build's switch path
+	int context_started;			// COOP: 0 until the context was entered once through setcontext
+	int cancel_requested;			// set by worker_cancel, acted on at the next cancellation point
+	int detached;					// set by worker_detach, the scheduler frees the thread once it finishes
+	struct worker_batch *batch;		// shared allocation of worker_create_n, NULL otherwise
 } tcb;
 
+/* header of a worker_create_n allocation, followed by the TCBs and stacks */
+typedef struct worker_batch
+{
+	int live_threads; // threads of the batch that were not joined yet
+} worker_batch;
+
 typedef uint worker_t;
 
 extern tcb *thread_table[MAX_THREADS];
@@ -59,7 +91,16 @@ extern tcb *thread_table[MAX_THREADS];
 int _populate_thread_context(tcb *thread_tcb);
 int _create_thread_context(tcb *thread_tcb, void *(*function)(void *), void *arg);
 int _create_thread(tcb **thread_tcb_pointer, worker_t *thread_id);
+int _init_worker_library();
 void create_thread_timer();
+int _switch_context(tcb *from, tcb *to);
+
+/* wait lists: park the current thread / move parked threads to the run queue */
+void _park_current_thread();
+int _wake_thread(tcb *thread);
+void _block_current_thread(queue_t *wait_list);
+int _wake_one_thread(queue_t *wait_list);
+void _wake_all_threads(queue_t *wait_list);
 
 /* mutex struct definition */
 typedef struct worker_mutex_t
@@ -69,12 +110,25 @@ typedef struct worker_mutex_t
 	// YOUR CODE HERE
 
 	volatile int locked; // Flag indicating whether the mutex is locked (1) or unlocked (0)
+	int pshared;		 // PTHREAD_PROCESS_SHARED: waiters use a futex on locked instead of block_list
 	tcb *owner;			 // Pointer to the TCB of the owning thread
 	queue_t *block_list; // Queue of TCBs of threads blocked waiting for this mutex
 
+	// Shared mutex: node in the owner's robust futex list while locked. The list
+	// is glibc's, so locked sits as far before robust_node as glibc's lock word.
+	void *robust_prev;
+	struct robust_list robust_node;
+
 } worker_mutex_t;
 
+/* condition variable struct definition */
+typedef struct worker_cond_t
+{
+	queue_t *wait_list; // Queue of TCBs of threads waiting for a signal
+} worker_cond_t;
+
 double compute_milliseconds(struct timespec start);
+unsigned long long read_cycle_counter();
 
 void setCurrentThread(tcb *thread_exec);
 tcb *getCurrentThread();
@@ -90,15 +144,39 @@ int thread_finished(tcb *thread);
 /* create a new thread */
 int worker_create(worker_t *thread, pthread_attr_t *attr, void *(*function)(void *), void *arg);
 
+/* create num_threads threads running function(args[i]) with one allocation */
+int worker_create_n(worker_t *threads, int num_threads, pthread_attr_t *attr, void *(*function)(void *), void **args);
+
 /* give CPU pocession to other user level worker threads voluntarily */
 int worker_yield();
 
+/* hand the rest of the quantum directly to a ready worker thread */
+int worker_yield_to(worker_t thread);
+
+/* sleep without holding the CPU */
+int worker_sleep(unsigned int milliseconds);
+
+/* wait for fd to become ready (poll events) without holding the CPU */
+int worker_wait_fd(int fd, short events);
+
+/* request deferred cancellation of a thread */
+int worker_cancel(worker_t thread);
+
+/* exit with WORKER_CANCELED if cancellation was requested */
+void worker_testcancel();
+
 /* terminate a thread */
 void worker_exit(void *value_ptr);
 
 /* wait for thread termination */
 int worker_join(worker_t thread, void **value_ptr);
 
+/* free the thread when it finishes, it can no longer be joined */
+int worker_detach(worker_t thread);
+
+/* id of the calling thread */
+worker_t worker_self();
+
 /* initial the mutex lock */
 int worker_mutex_init(worker_mutex_t *mutex, const pthread_mutexattr_t
 												 *mutexattr);
@@ -112,6 +190,28 @@ int worker_mutex_unlock(worker_mutex_t *mutex);
 /* destroy the mutex */
 int worker_mutex_destroy(worker_mutex_t *mutex);
 
+/* aquire the mutex lock only if it is free */
+int worker_mutex_trylock(worker_mutex_t *mutex);
+
+/* aquire the mutex lock, giving up at the CLOCK_REALTIME deadline abstime */
+int worker_mutex_timedlock(worker_mutex_t *mutex, const struct timespec *abstime);
+
+/* initial the condition variable */
+int worker_cond_init(worker_cond_t *cond, const pthread_condattr_t *condattr);
+
+/* release the mutex and wait for a signal */
+int worker_cond_wait(worker_cond_t *cond, worker_mutex_t *mutex);
+
+/* like worker_cond_wait, returns 0 with the mutex held again once the CLOCK_REALTIME deadline abstime passed */
+int worker_cond_timedwait(worker_cond_t *cond, worker_mutex_t *mutex, const struct timespec *abstime);
+
+/* wake one / every waiting thread */
+int worker_cond_signal(worker_cond_t *cond);
+int worker_cond_broadcast(worker_cond_t *cond);
+
+/* destroy the condition variable */
+int worker_cond_destroy(worker_cond_t *cond);
+
 /* Scheduler */
 typedef struct sigaction signal_type;
 void *schedule_entry_point(void *args);
@@ -129,10 +229,21 @@ void print_app_stats(void);
 #define pthread_create worker_create
 #define pthread_exit worker_exit
 #define pthread_join worker_join
+#define pthread_detach worker_detach
+#define pthread_self worker_self
 #define pthread_mutex_init worker_mutex_init
 #define pthread_mutex_lock worker_mutex_lock
 #define pthread_mutex_unlock worker_mutex_unlock
 #define pthread_mutex_destroy worker_mutex_destroy
+#define pthread_mutex_trylock worker_mutex_trylock
+#define pthread_mutex_timedlock worker_mutex_timedlock
+#define pthread_cond_t worker_cond_t
+#define pthread_cond_init worker_cond_init
+#define pthread_cond_wait worker_cond_wait
+#define pthread_cond_timedwait worker_cond_timedwait
+#define pthread_cond_signal worker_cond_signal
+#define pthread_cond_broadcast worker_cond_broadcast
+#define pthread_cond_destroy worker_cond_destroy
 #endif
 
 #endif
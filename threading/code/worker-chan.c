@@ -0,0 +1,287 @@
+// File:	worker-chan.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "worker-chan.h"
+
+#define SELECT_STACK_CASES 4
+
+/* A parked sender or receiver. Lives on the stack of the parked thread. */
+typedef struct chan_waiter
+{
+    tcb *thread;
+    void *value;
+    int case_index;
+    int *selected; // Shared by every arm of one select, -1 until an arm fires
+    int ok;
+} chan_waiter;
+
+static void *chan_slot(worker_chan_t *chan, size_t index)
+{
+    return chan->buffer + (index % chan->capacity) * chan->elem_size;
+}
+
+static chan_waiter *chan_pop_waiter(queue_t *waiters)
+{
+    // skip arms of a select that already fired on another channel.
+    while (!is_empty(waiters))
+    {
+        chan_waiter *waiter = dequeue(waiters);
+        if (*waiter->selected == -1)
+        {
+            return waiter;
+        }
+    }
+    return NULL;
+}
+
+static void chan_fire(chan_waiter *waiter, int ok)
+{
+    *waiter->selected = waiter->case_index;
+    waiter->ok = ok;
+    _wake_thread(waiter->thread);
+}
+
+/* returns 1 if the value was sent, 0 if it would block, -1 if the channel is closed */
+static int chan_try_send(worker_chan_t *chan, const void *value)
+{
+    if (chan->closed)
+    {
+        return -1;
+    }
+    // direct handoff: copy straight into a parked receiver.
+    chan_waiter *receiver = chan_pop_waiter(chan->recv_waiters);
+    if (receiver != NULL)
+    {
+        memcpy(receiver->value, value, chan->elem_size);
+        chan_fire(receiver, 1);
+        return 1;
+    }
+    if (chan->count < chan->capacity)
+    {
+        memcpy(chan_slot(chan, chan->head + chan->count), value, chan->elem_size);
+        chan->count++;
+        return 1;
+    }
+    return 0;
+}
+
+/* returns 1 if a value was received, 0 if it would block, -1 if the channel is closed */
+static int chan_try_recv(worker_chan_t *chan, void *value)
+{
+    if (chan->count > 0)
+    {
+        memcpy(value, chan_slot(chan, chan->head), chan->elem_size);
+        chan->head = (chan->head + 1) % chan->capacity;
+        chan->count--;
+
+        // the freed slot goes to the oldest parked sender.
+        chan_waiter *sender = chan_pop_waiter(chan->send_waiters);
+        if (sender != NULL)
+        {
+            memcpy(chan_slot(chan, chan->head + chan->count), sender->value, chan->elem_size);
+            chan->count++;
+            chan_fire(sender, 1);
+        }
+        return 1;
+    }
+    // unbuffered channel: copy straight out of a parked sender.
+    chan_waiter *sender = chan_pop_waiter(chan->send_waiters);
+    if (sender != NULL)
+    {
+        memcpy(value, sender->value, chan->elem_size);
+        chan_fire(sender, 1);
+        return 1;
+    }
+    if (chan->closed)
+    {
+        memset(value, 0, chan->elem_size);
+        return -1;
+    }
+    return 0;
+}
+
+int worker_chan_init(worker_chan_t *chan, size_t elem_size, size_t capacity)
+{
+    if (chan == NULL || elem_size == 0)
+    {
+        return ERROR_CODE;
+    }
+    chan->elem_size = elem_size;
+    chan->capacity = capacity;
+    chan->buffer = NULL;
+    if (capacity > 0 && !safe_malloc((void **)&chan->buffer, elem_size * capacity))
+    {
+        return ERROR_CODE;
+    }
+    chan->head = 0;
+    chan->count = 0;
+    chan->closed = 0;
+    chan->send_waiters = create_queue();
+    chan->recv_waiters = create_queue();
+    return 1;
+}
+
+int worker_chan_select(worker_chan_case_t *cases, int num_cases, int block)
+{
+    /**
+     * Fast path: take the first arm that can proceed without blocking.
+     *
+     * Otherwise park one waiter per arm on its channel, all sharing the
+     * selected index. The first channel operation to complete fires the
+     * waiter and wakes us up; the other waiters become stale and are
+     * unlinked before returning.
+     */
+    if (cases == NULL || num_cases < 1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < num_cases; i++)
+    {
+        int status = cases[i].op == CHAN_SEND ? chan_try_send(cases[i].chan, cases[i].value)
+                                              : chan_try_recv(cases[i].chan, cases[i].value);
+        if (status != 0)
+        {
+            cases[i].ok = status > 0;
+            return i;
+        }
+    }
+    if (!block)
+    {
+        return -1;
+    }
+
+    chan_waiter stack_waiters[SELECT_STACK_CASES];
+    chan_waiter *waiters = stack_waiters;
+    if (num_cases > SELECT_STACK_CASES && !safe_malloc((void **)&waiters, num_cases * sizeof(chan_waiter)))
+    {
+        return -1;
+    }
+
+    int selected = -1;
+    for (int i = 0; i < num_cases; i++)
+    {
+        waiters[i].thread = getCurrentThread();
+        waiters[i].value = cases[i].value;
+        waiters[i].case_index = i;
+        waiters[i].selected = &selected;
+        waiters[i].ok = 0;
+        enqueue(cases[i].op == CHAN_SEND ? cases[i].chan->send_waiters : cases[i].chan->recv_waiters, &waiters[i]);
+    }
+    while (selected == -1)
+    {
+        _park_current_thread();
+        // woken by worker_cancel: unlink every arm and exit.
+        if (selected == -1 && getCurrentThread()->cancel_requested)
+        {
+            for (int i = 0; i < num_cases; i++)
+            {
+                remove_item(cases[i].op == CHAN_SEND ? cases[i].chan->send_waiters : cases[i].chan->recv_waiters, &waiters[i]);
+            }
+            if (waiters != stack_waiters)
+            {
+                free(waiters);
+            }
+            worker_exit(WORKER_CANCELED);
+        }
+    }
+    for (int i = 0; i < num_cases; i++)
+    {
+        if (i != selected)
+        {
+            remove_item(cases[i].op == CHAN_SEND ? cases[i].chan->send_waiters : cases[i].chan->recv_waiters, &waiters[i]);
+        }
+    }
+
+    cases[selected].ok = waiters[selected].ok;
+    if (waiters != stack_waiters)
+    {
+        free(waiters);
+    }
+    return selected;
+}
+
+int worker_chan_send(worker_chan_t *chan, const void *value)
+{
+    worker_chan_case_t send_case = {chan, CHAN_SEND, (void *)value, 0};
+    worker_chan_select(&send_case, 1, 1);
+    return send_case.ok;
+}
+
+int worker_chan_recv(worker_chan_t *chan, void *value)
+{
+    worker_chan_case_t recv_case = {chan, CHAN_RECV, value, 0};
+    worker_chan_select(&recv_case, 1, 1);
+    return recv_case.ok;
+}
+
+/* map the 1 / 0 / -1 of chan_try_send and chan_try_recv to 1, or 0 with errno EAGAIN / EPIPE */
+static int chan_try_status(int status)
+{
+    if (status > 0)
+    {
+        return 1;
+    }
+    errno = status == 0 ? EAGAIN : EPIPE;
+    return ERROR_CODE;
+}
+
+int worker_chan_try_send(worker_chan_t *chan, const void *value)
+{
+    if (chan == NULL)
+    {
+        errno = EINVAL;
+        return ERROR_CODE;
+    }
+    return chan_try_status(chan_try_send(chan, value));
+}
+
+int worker_chan_try_recv(worker_chan_t *chan, void *value)
+{
+    if (chan == NULL)
+    {
+        errno = EINVAL;
+        return ERROR_CODE;
+    }
+    return chan_try_status(chan_try_recv(chan, value));
+}
+
+int worker_chan_close(worker_chan_t *chan)
+{
+    if (chan == NULL || chan->closed)
+    {
+        return ERROR_CODE;
+    }
+    chan->closed = 1;
+
+    chan_waiter *waiter;
+    while ((waiter = chan_pop_waiter(chan->recv_waiters)) != NULL)
+    {
+        memset(waiter->value, 0, chan->elem_size);
+        chan_fire(waiter, 0);
+    }
+    while ((waiter = chan_pop_waiter(chan->send_waiters)) != NULL)
+    {
+        chan_fire(waiter, 0);
+    }
+    return 1;
+}
+
+int worker_chan_destroy(worker_chan_t *chan)
+{
+    if (chan == NULL)
+    {
+        return ERROR_CODE;
+    }
+    // a parked thread still references this channel.
+    if (!is_empty(chan->send_waiters) || !is_empty(chan->recv_waiters))
+    {
+        return ERROR_CODE;
+    }
+    destroy_queue(chan->send_waiters);
+    destroy_queue(chan->recv_waiters);
+    free(chan->buffer);
+    return 1;
+}
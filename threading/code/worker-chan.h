@@ -0,0 +1,60 @@
+#ifndef WORKER_CHAN_H
+#define WORKER_CHAN_H
+
+#include "thread-worker.h"
+
+/* channel struct definition */
+typedef struct worker_chan_t
+{
+	size_t elem_size; // Size in bytes of one value
+	size_t capacity;  // Number of buffered values, 0 for an unbuffered channel
+	char *buffer;	  // Ring buffer of capacity * elem_size bytes
+	size_t head;	  // Index of the oldest buffered value
+	size_t count;	  // Number of buffered values
+	int closed;
+
+	queue_t *send_waiters; // Senders parked on this channel
+	queue_t *recv_waiters; // Receivers parked on this channel
+} worker_chan_t;
+
+typedef enum
+{
+	CHAN_SEND,
+	CHAN_RECV
+} Chan_op;
+
+/* one arm of worker_chan_select */
+typedef struct worker_chan_case_t
+{
+	worker_chan_t *chan;
+	Chan_op op;
+	void *value; // Value to send, or buffer to receive into
+	int ok;		 // Set by select: 0 if the arm fired because the channel was closed
+} worker_chan_case_t;
+
+/* initialize a channel of capacity values of elem_size bytes each */
+int worker_chan_init(worker_chan_t *chan, size_t elem_size, size_t capacity);
+
+/* send a value, blocking until a receiver or a buffer slot takes it */
+int worker_chan_send(worker_chan_t *chan, const void *value);
+
+/* receive a value, blocking until one is available */
+int worker_chan_recv(worker_chan_t *chan, void *value);
+
+/* send or receive only if it can be done without blocking.
+   Returns 1 on success. On failure returns 0 and sets errno to EAGAIN if it would
+   block, or EPIPE if the channel is closed. */
+int worker_chan_try_send(worker_chan_t *chan, const void *value);
+int worker_chan_try_recv(worker_chan_t *chan, void *value);
+
+/* wait for the first of several operations, returns the index of the arm that fired.
+   Returns -1 if block is 0 and no arm is ready. */
+int worker_chan_select(worker_chan_case_t *cases, int num_cases, int block);
+
+/* close the channel and wake every parked sender and receiver */
+int worker_chan_close(worker_chan_t *chan);
+
+/* destroy the channel */
+int worker_chan_destroy(worker_chan_t *chan);
+
+#endif
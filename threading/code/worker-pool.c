@@ -0,0 +1,189 @@
+// File:	worker-pool.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "worker-pool.h"
+
+static void *pool_worker_loop(void *arg)
+{
+    /**
+     * Body of every pool worker.
+     *
+     * Park on the idle list while there is nothing to do.
+     * Take the job at the head of the ring buffer and free its slot
+     * for a blocked submitter.
+     * Run the job on this worker's stack, so TCB and stack are reused.
+     * Exit once the pool is shut down and the queue is drained.
+     */
+    worker_pool_t *pool = arg;
+    while (1)
+    {
+        while (pool->count == 0 && !pool->shutdown)
+        {
+            _block_current_thread(pool->idle_list);
+        }
+        if (pool->count == 0)
+        {
+            break;
+        }
+
+        worker_job_t job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        _wake_one_thread(pool->submit_list);
+
+        job.function(job.arg);
+
+        pool->pending--;
+        if (pool->pending == 0)
+        {
+            _wake_all_threads(pool->drain_list);
+        }
+    }
+    return NULL;
+}
+
+static void pool_enqueue_job(worker_pool_t *pool, void *(*function)(void *), void *arg)
+{
+    int tail = (pool->head + pool->count) % pool->capacity;
+    pool->jobs[tail].function = function;
+    pool->jobs[tail].arg = arg;
+    pool->count++;
+    pool->pending++;
+
+    // hand the job to a parked worker, no new thread is created.
+    _wake_one_thread(pool->idle_list);
+}
+
+int worker_pool_init(worker_pool_t *pool, int num_workers, int queue_capacity)
+{
+    /**
+     * Allocate the ring buffer and wait lists.
+     * Create the workers once, they park on the idle list until
+     * the first job is submitted.
+     * If a worker cannot be created, the ones already running are
+     * canceled and joined and everything is freed again.
+     */
+    if (pool == NULL || num_workers < 1 || queue_capacity < 1)
+    {
+        return ERROR_CODE;
+    }
+    pool->num_workers = num_workers;
+    pool->capacity = queue_capacity;
+    pool->head = 0;
+    pool->count = 0;
+    pool->pending = 0;
+    pool->shutdown = 0;
+
+    pool->workers = calloc(num_workers, sizeof(worker_t));
+    pool->jobs = calloc(queue_capacity, sizeof(worker_job_t));
+    if (pool->workers == NULL || pool->jobs == NULL)
+    {
+        free(pool->workers);
+        free(pool->jobs);
+        return ERROR_CODE;
+    }
+    pool->idle_list = create_queue();
+    pool->submit_list = create_queue();
+    pool->drain_list = create_queue();
+
+    int created;
+    for (created = 0; created < num_workers; created++)
+    {
+        if (!worker_create(&pool->workers[created], NULL, pool_worker_loop, pool))
+        {
+            goto fail;
+        }
+    }
+    return 1;
+
+fail:
+    // the workers created so far are parked on the idle list, cancel wakes them up.
+    for (int i = 0; i < created; i++)
+    {
+        worker_cancel(pool->workers[i]);
+    }
+    for (int i = 0; i < created; i++)
+    {
+        worker_join(pool->workers[i], NULL);
+    }
+    destroy_queue(pool->idle_list);
+    destroy_queue(pool->submit_list);
+    destroy_queue(pool->drain_list);
+    free(pool->workers);
+    free(pool->jobs);
+    return ERROR_CODE;
+}
+
+int worker_pool_submit(worker_pool_t *pool, void *(*function)(void *), void *arg)
+{
+    if (pool == NULL || function == NULL || pool->shutdown)
+    {
+        return ERROR_CODE;
+    }
+    // backpressure: wait for a worker to free a slot.
+    while (pool->count == pool->capacity)
+    {
+        _block_current_thread(pool->submit_list);
+        if (pool->shutdown)
+        {
+            return ERROR_CODE;
+        }
+    }
+    pool_enqueue_job(pool, function, arg);
+    return 1;
+}
+
+int worker_pool_try_submit(worker_pool_t *pool, void *(*function)(void *), void *arg)
+{
+    if (pool == NULL || function == NULL || pool->shutdown)
+    {
+        return ERROR_CODE;
+    }
+    if (pool->count == pool->capacity)
+    {
+        return ERROR_CODE;
+    }
+    pool_enqueue_job(pool, function, arg);
+    return 1;
+}
+
+int worker_pool_wait(worker_pool_t *pool)
+{
+    if (pool == NULL)
+    {
+        return ERROR_CODE;
+    }
+    while (pool->pending > 0)
+    {
+        _block_current_thread(pool->drain_list);
+    }
+    return 1;
+}
+
+int worker_pool_destroy(worker_pool_t *pool)
+{
+    /**
+     * Let the workers drain the queue, then wake every parked worker
+     * so it can observe the shutdown flag and exit.
+     */
+    if (pool == NULL)
+    {
+        return ERROR_CODE;
+    }
+    pool->shutdown = 1;
+    _wake_all_threads(pool->submit_list);
+    _wake_all_threads(pool->idle_list);
+
+    for (int i = 0; i < pool->num_workers; i++)
+    {
+        worker_join(pool->workers[i], NULL);
+    }
+
+    destroy_queue(pool->idle_list);
+    destroy_queue(pool->submit_list);
+    destroy_queue(pool->drain_list);
+    free(pool->workers);
+    free(pool->jobs);
+    return 1;
+}
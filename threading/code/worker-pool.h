@@ -0,0 +1,46 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "thread-worker.h"
+
+/* a unit of work handed to a pool worker */
+typedef struct worker_job_t
+{
+	void *(*function)(void *);
+	void *arg;
+} worker_job_t;
+
+/* pool struct definition */
+typedef struct worker_pool_t
+{
+	worker_t *workers; // Parked worker threads, created once in worker_pool_init
+	int num_workers;
+
+	worker_job_t *jobs; // Bounded ring buffer of submitted jobs
+	int capacity;		// Number of slots in the ring buffer
+	int head;			// Index of the next job to run
+	int count;			// Number of queued jobs
+	int pending;		// Number of submitted jobs that did not finish yet
+	int shutdown;		// Set by worker_pool_destroy
+
+	queue_t *idle_list;	  // Workers waiting for a job
+	queue_t *submit_list; // Submitters waiting for a free slot (backpressure)
+	queue_t *drain_list;  // Threads waiting in worker_pool_wait
+} worker_pool_t;
+
+/* create num_workers parked workers and a job queue of queue_capacity slots */
+int worker_pool_init(worker_pool_t *pool, int num_workers, int queue_capacity);
+
+/* queue a job, blocking while the job queue is full */
+int worker_pool_submit(worker_pool_t *pool, void *(*function)(void *), void *arg);
+
+/* queue a job, fail instead of blocking when the job queue is full */
+int worker_pool_try_submit(worker_pool_t *pool, void *(*function)(void *), void *arg);
+
+/* wait until every submitted job has finished */
+int worker_pool_wait(worker_pool_t *pool);
+
+/* finish the queued jobs, join the workers and free the pool */
+int worker_pool_destroy(worker_pool_t *pool);
+
+#endif
@@ -1,5 +1,23 @@
 #include "bitmap.h"
 
+/*
+ * data is only accessed one 64 bit word at a time, bit i is bit i % 64 of
+ * word i / 64. It holds the swap slots in use, swap_bitmap in my_vm.c.
+ */
+static uint64_t *bitmap_words(CharBitmap *bp)
+{
+    return (uint64_t *)bp->data;
+}
+
+static void update_summary(CharBitmap *bp, size_t word_index)
+{
+    uint64_t mask = 1ULL << (word_index % BITMAP_WORD_BITS);
+    if (bitmap_words(bp)[word_index] == UINT64_MAX)
+        bp->summary[word_index / BITMAP_WORD_BITS] |= mask;
+    else
+        bp->summary[word_index / BITMAP_WORD_BITS] &= ~mask;
+}
+
 CharBitmap *init_bitmap(size_t num_bits)
 {
     CharBitmap *bp = malloc(sizeof(CharBitmap));
@@ -9,15 +27,29 @@ CharBitmap *init_bitmap(size_t num_bits)
         exit(1);
     }
 
-    // add the padding of 7 bits to ensure the correct # bytes is returned.
-    size_t numCharBytes = (num_bits + 7) / 8;
-    bp->data = (char *)calloc(numCharBytes, sizeof(char));
-    if (bp->data == NULL)
+    // round up to whole words so the search can read a word at a time.
+    bp->num_words = (num_bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    size_t num_summary_words = (bp->num_words + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    bp->data = (char *)calloc(bp->num_words, sizeof(uint64_t));
+    bp->summary = calloc(num_summary_words, sizeof(uint64_t));
+    if (bp->data == NULL || bp->summary == NULL)
     {
         fprintf(stderr, "%s at line %d: failed to allocate bitmap.\n", __func__, __LINE__);
         exit(1);
     }
     bp->size = num_bits;
+    bp->hint = 0;
+
+    // padding bits past the end are marked used, so they are never returned
+    // and a partly filled last word can still be full.
+    if (num_bits % BITMAP_WORD_BITS != 0)
+    {
+        bitmap_words(bp)[bp->num_words - 1] = UINT64_MAX << (num_bits % BITMAP_WORD_BITS);
+    }
+    if (bp->num_words % BITMAP_WORD_BITS != 0)
+    {
+        bp->summary[num_summary_words - 1] = UINT64_MAX << (bp->num_words % BITMAP_WORD_BITS);
+    }
     return bp;
 }
 
@@ -28,10 +60,11 @@ void set_bit(CharBitmap *bp, size_t position)
         fprintf(stderr, "%s at line %d: cannot index bitmap at %zu because size is %zu\n", __func__, __LINE__, position, bp->size);
         exit(1);
     }
-    size_t byteIndex = position / 8;
-    size_t bitIndex = position % 8;
+    size_t wordIndex = position / BITMAP_WORD_BITS;
+    size_t bitIndex = position % BITMAP_WORD_BITS;
 
-    bp->data[byteIndex] |= (1 << bitIndex);
+    bitmap_words(bp)[wordIndex] |= (1ULL << bitIndex);
+    update_summary(bp, wordIndex);
 }
 
 void clear_bit(CharBitmap *bp, size_t position)
@@ -41,10 +74,11 @@ void clear_bit(CharBitmap *bp, size_t position)
         fprintf(stderr, "%s at line %d: cannot index bitmap at %zu because size is %zu\n", __func__, __LINE__, position, bp->size);
         exit(1);
     }
-    size_t byteIndex = position / 8;
-    size_t bitIndex = position % 8;
+    size_t wordIndex = position / BITMAP_WORD_BITS;
+    size_t bitIndex = position % BITMAP_WORD_BITS;
 
-    bp->data[byteIndex] &= ~(1 << bitIndex);
+    bitmap_words(bp)[wordIndex] &= ~(1ULL << bitIndex);
+    update_summary(bp, wordIndex);
 }
 
 int get_bit(CharBitmap *bp, size_t position)
@@ -54,23 +88,37 @@ int get_bit(CharBitmap *bp, size_t position)
         fprintf(stderr, "%s at line %d: cannot index bitmap at %zu because size is %zu\n", __func__, __LINE__, position, bp->size);
         exit(1);
     }
-    size_t byteIndex = position / 8;
-    size_t bitIndex = position % 8;
+    size_t wordIndex = position / BITMAP_WORD_BITS;
+    size_t bitIndex = position % BITMAP_WORD_BITS;
 
-    return (bp->data[byteIndex] & (1 << bitIndex)) != 0;
+    return (bitmap_words(bp)[wordIndex] & (1ULL << bitIndex)) != 0;
 }
 
 int get_free_bit(CharBitmap *bp)
 {
-    for (size_t i = 0; i < bp->size; ++i)
+    /*
+     * The summary has one bit per data word, so one summary word covers
+     * 4096 bits. Starting at the hint, find the first summary word with a
+     * clear bit, then the first clear bit of that data word: two count
+     * trailing zeros, however full the bitmap is. The hint rotates to the
+     * word that had a free bit, the next search starts there.
+     */
+    size_t num_summary_words = (bp->num_words + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    size_t start = bp->hint / BITMAP_WORD_BITS;
+    for (size_t n = 0; n <= num_summary_words; ++n)
     {
-        size_t charIndex = i / 8;
-        size_t bitIndex = i % 8;
-        int bitValue = get_bit(bp, i);
-        if (bitValue == 0)
-        {
-            return i;
-        }
+        size_t summaryIndex = (start + n) % num_summary_words;
+        uint64_t not_full = ~bp->summary[summaryIndex];
+        // on the first summary word, skip the words before the hint
+        if (n == 0)
+            not_full &= UINT64_MAX << (bp->hint % BITMAP_WORD_BITS);
+        if (not_full == 0)
+            continue;
+
+        size_t wordIndex = summaryIndex * BITMAP_WORD_BITS + __builtin_ctzll(not_full);
+        size_t bitIndex = __builtin_ctzll(~bitmap_words(bp)[wordIndex]);
+        bp->hint = wordIndex;
+        return wordIndex * BITMAP_WORD_BITS + bitIndex;
     }
     return -1;
 }
@@ -99,6 +147,7 @@ void print_bitmap(CharBitmap *bitmap, int lines)
 void free_bitmap(CharBitmap *bitmap)
 {
     free(bitmap->data);
+    free(bitmap->summary);
     free(bitmap);
 }
 
@@ -3,11 +3,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdint.h>
+
+#define BITMAP_WORD_BITS 64
 
 typedef struct
 {
-    char *data;  // The bitmap (0-indexed)
+    char *data;  // The bitmap (0-indexed), padded to whole 64 bit words
     size_t size; // Number of bits to be stored in bitmap
+
+    uint64_t *summary; // Bit w is set when word w of data has no free bit
+    size_t num_words;  // Number of 64 bit words in data
+    size_t hint;       // Word where the next free bit search starts
 } CharBitmap;
 
 CharBitmap *init_bitmap(size_t num_bits);
@@ -0,0 +1,159 @@
+#include "buddy.h"
+
+static void push_block(BuddyAllocator *buddy, size_t frame, int order)
+{
+    long head = buddy->free_list[order];
+    buddy->next[frame] = head;
+    buddy->prev[frame] = -1;
+    if (head != -1)
+    {
+        buddy->prev[head] = frame;
+    }
+    buddy->free_list[order] = frame;
+    buddy->free_order[frame] = order;
+}
+
+static void unlink_block(BuddyAllocator *buddy, size_t frame, int order)
+{
+    long next = buddy->next[frame];
+    long prev = buddy->prev[frame];
+    if (prev != -1)
+        buddy->next[prev] = next;
+    else
+        buddy->free_list[order] = next;
+    if (next != -1)
+        buddy->prev[next] = prev;
+    buddy->free_order[frame] = -1;
+}
+
+/*
+ * Free every frame of [start, end) as the largest aligned blocks that fit.
+ */
+static void put_free_range(BuddyAllocator *buddy, size_t start, size_t end)
+{
+    while (start < end)
+    {
+        int order = 0;
+        while (order + 1 < BUDDY_ORDERS && start % (1UL << (order + 1)) == 0 && start + (1UL << (order + 1)) <= end)
+        {
+            order++;
+        }
+        put_free_block(buddy, start, order);
+        start += 1UL << order;
+    }
+}
+
+BuddyAllocator *init_buddy(size_t first_frame, size_t num_frames)
+{
+    BuddyAllocator *buddy = malloc(sizeof(BuddyAllocator));
+    if (buddy == NULL)
+    {
+        fprintf(stderr, "%s at line %d: failed to allocate buddy allocator.\n", __func__, __LINE__);
+        exit(1);
+    }
+    buddy->num_frames = num_frames;
+    buddy->next = malloc(num_frames * sizeof(long));
+    buddy->prev = malloc(num_frames * sizeof(long));
+    buddy->free_order = malloc(num_frames * sizeof(signed char));
+    if (buddy->next == NULL || buddy->prev == NULL || buddy->free_order == NULL)
+    {
+        fprintf(stderr, "%s at line %d: failed to allocate buddy free lists.\n", __func__, __LINE__);
+        exit(1);
+    }
+    for (int order = 0; order < BUDDY_ORDERS; ++order)
+    {
+        buddy->free_list[order] = -1;
+    }
+    for (size_t i = 0; i < num_frames; ++i)
+    {
+        buddy->free_order[i] = -1;
+    }
+    buddy->free_frames = 0;
+    // frames before first_frame stay allocated forever.
+    put_free_range(buddy, first_frame, num_frames);
+    return buddy;
+}
+
+void free_buddy(BuddyAllocator *buddy)
+{
+    free(buddy->next);
+    free(buddy->prev);
+    free(buddy->free_order);
+    free(buddy);
+}
+
+/*
+ * Allocate 2^order contiguous frames, aligned to their size.
+ * A larger block is split in halves, the unused halves go back to the
+ * free lists. Returns the first frame, or -1 if no block is large enough.
+ */
+long get_free_block(BuddyAllocator *buddy, int order)
+{
+    int found = order;
+    while (found < BUDDY_ORDERS && buddy->free_list[found] == -1)
+    {
+        found++;
+    }
+    if (found == BUDDY_ORDERS)
+    {
+        return -1;
+    }
+    long frame = buddy->free_list[found];
+    unlink_block(buddy, frame, found);
+    while (found > order)
+    {
+        found--;
+        push_block(buddy, frame + (1UL << found), found);
+    }
+    buddy->free_frames -= 1UL << order;
+    return frame;
+}
+
+/*
+ * Free a block of 2^order frames. While its buddy, the other half of the
+ * block one order up, is free too, the two merge into that block.
+ */
+void put_free_block(BuddyAllocator *buddy, size_t frame, int order)
+{
+    buddy->free_frames += 1UL << order;
+    while (order + 1 < BUDDY_ORDERS)
+    {
+        size_t buddy_frame = frame ^ (1UL << order);
+        if (buddy_frame >= buddy->num_frames || buddy->free_order[buddy_frame] != order)
+        {
+            break;
+        }
+        unlink_block(buddy, buddy_frame, order);
+        if (buddy_frame < frame)
+        {
+            frame = buddy_frame;
+        }
+        order++;
+    }
+    push_block(buddy, frame, order);
+}
+
+/*
+ * Allocate num_frames contiguous frames: the smallest block that holds
+ * them, with the frames past num_frames freed again.
+ * Returns the first frame, or -1 if there is no large enough block.
+ */
+long get_free_frames(BuddyAllocator *buddy, size_t num_frames)
+{
+    int order = 0;
+    while ((1UL << order) < num_frames)
+    {
+        order++;
+    }
+    if (order >= BUDDY_ORDERS)
+    {
+        return -1;
+    }
+    long frame = get_free_block(buddy, order);
+    if (frame == -1)
+    {
+        return -1;
+    }
+    put_free_range(buddy, frame + num_frames, frame + (1UL << order));
+    return frame;
+}
@@ -0,0 +1,24 @@
+#ifndef BUDDY_H_INCLUDED
+#define BUDDY_H_INCLUDED
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define BUDDY_ORDERS 32
+
+typedef struct
+{
+    size_t num_frames;               // Number of frames managed, frames at or past it do not exist
+    long free_list[BUDDY_ORDERS];    // First free block of each order, -1 if there is none
+    long *next;                      // Next free block of the same order, indexed by first frame
+    long *prev;                      // Previous free block of the same order, indexed by first frame
+    signed char *free_order;         // Order of the free block starting at a frame, -1 if none starts there
+    size_t free_frames;              // Total number of free frames
+} BuddyAllocator;
+
+BuddyAllocator *init_buddy(size_t first_frame, size_t num_frames);
+void free_buddy(BuddyAllocator *buddy);
+long get_free_block(BuddyAllocator *buddy, int order);
+void put_free_block(BuddyAllocator *buddy, size_t frame, int order);
+long get_free_frames(BuddyAllocator *buddy, size_t num_frames);
+#endif
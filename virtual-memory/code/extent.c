@@ -0,0 +1,325 @@
+#include "extent.h"
+
+#define BY_ADDRESS 0
+#define BY_SIZE 1
+
+/*
+ * Order of two extents in one of the treaps. Keys are unique: free runs
+ * never overlap, and runs of the same size are ordered by start page.
+ */
+static bool extent_less(extent *a, extent *b, int tree)
+{
+    if (tree == BY_SIZE && a->num_pages != b->num_pages)
+    {
+        return a->num_pages < b->num_pages;
+    }
+    return a->start < b->start;
+}
+
+/*
+ * Join two treaps where every extent of left orders before right.
+ */
+static extent *merge_treap(extent *left, extent *right, int tree)
+{
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+    if (left->priority > right->priority)
+    {
+        left->child[tree][1] = merge_treap(left->child[tree][1], right, tree);
+        return left;
+    }
+    right->child[tree][0] = merge_treap(left, right->child[tree][0], tree);
+    return right;
+}
+
+/*
+ * Split a treap into the extents ordered before key and the others.
+ */
+static void split_treap(extent *root, extent *key, int tree, extent **left, extent **right)
+{
+    if (root == NULL)
+    {
+        *left = *right = NULL;
+        return;
+    }
+    if (extent_less(root, key, tree))
+    {
+        split_treap(root->child[tree][1], key, tree, &root->child[tree][1], right);
+        *left = root;
+    }
+    else
+    {
+        split_treap(root->child[tree][0], key, tree, left, &root->child[tree][0]);
+        *right = root;
+    }
+}
+
+static extent *insert_treap(extent *root, extent *node, int tree)
+{
+    if (root == NULL)
+    {
+        node->child[tree][0] = node->child[tree][1] = NULL;
+        return node;
+    }
+    if (node->priority > root->priority)
+    {
+        split_treap(root, node, tree, &node->child[tree][0], &node->child[tree][1]);
+        return node;
+    }
+    int side = !extent_less(node, root, tree);
+    root->child[tree][side] = insert_treap(root->child[tree][side], node, tree);
+    return root;
+}
+
+static extent *remove_treap(extent *root, extent *node, int tree)
+{
+    if (root == node)
+    {
+        return merge_treap(root->child[tree][0], root->child[tree][1], tree);
+    }
+    int side = !extent_less(node, root, tree);
+    root->child[tree][side] = remove_treap(root->child[tree][side], node, tree);
+    return root;
+}
+
+static void insert_extent(ExtentIndex *index, extent *node)
+{
+    index->by_address = insert_treap(index->by_address, node, BY_ADDRESS);
+    index->by_size = insert_treap(index->by_size, node, BY_SIZE);
+}
+
+static void remove_extent(ExtentIndex *index, extent *node)
+{
+    index->by_address = remove_treap(index->by_address, node, BY_ADDRESS);
+    index->by_size = remove_treap(index->by_size, node, BY_SIZE);
+}
+
+static extent *new_extent(ExtentIndex *index, size_t start, size_t num_pages)
+{
+    extent *node = malloc(sizeof(extent));
+    if (node == NULL)
+    {
+        fprintf(stderr, "%s at line %d: failed to allocate extent.\n", __func__, __LINE__);
+        exit(1);
+    }
+    // xorshift, the treaps only need priorities that look random.
+    index->seed ^= index->seed << 13;
+    index->seed ^= index->seed >> 17;
+    index->seed ^= index->seed << 5;
+    node->start = start;
+    node->num_pages = num_pages;
+    node->priority = index->seed;
+    return node;
+}
+
+/*
+ * The free run that starts at or before page, NULL if every run starts after it.
+ */
+static extent *floor_extent(ExtentIndex *index, size_t page)
+{
+    extent *found = NULL;
+    extent *node = index->by_address;
+    while (node != NULL)
+    {
+        if (node->start <= page)
+        {
+            found = node;
+            node = node->child[BY_ADDRESS][1];
+        }
+        else
+        {
+            node = node->child[BY_ADDRESS][0];
+        }
+    }
+    return found;
+}
+
+/*
+ * The free run that starts after page, NULL if there is none.
+ */
+static extent *ceiling_extent(ExtentIndex *index, size_t page)
+{
+    extent *found = NULL;
+    extent *node = index->by_address;
+    while (node != NULL)
+    {
+        if (node->start > page)
+        {
+            found = node;
+            node = node->child[BY_ADDRESS][0];
+        }
+        else
+        {
+            node = node->child[BY_ADDRESS][1];
+        }
+    }
+    return found;
+}
+
+ExtentIndex *init_extent_index(size_t first_page, size_t num_pages)
+{
+    ExtentIndex *index = malloc(sizeof(ExtentIndex));
+    if (index == NULL)
+    {
+        fprintf(stderr, "%s at line %d: failed to allocate extent index.\n", __func__, __LINE__);
+        exit(1);
+    }
+    index->by_address = NULL;
+    index->by_size = NULL;
+    index->free_pages = 0;
+    index->seed = 2463534242u;
+    put_free_extent(index, first_page, num_pages);
+    return index;
+}
+
+static void free_treap(extent *node)
+{
+    if (node == NULL)
+        return;
+    free_treap(node->child[BY_ADDRESS][0]);
+    free_treap(node->child[BY_ADDRESS][1]);
+    free(node);
+}
+
+void free_extent_index(ExtentIndex *index)
+{
+    free_treap(index->by_address);
+    free(index);
+}
+
+/*
+ * Best fit: take num_pages from the front of the smallest free run that
+ * holds them. Returns the first page, or -1 if no run is long enough.
+ */
+long get_free_extent(ExtentIndex *index, size_t num_pages)
+{
+    if (num_pages == 0)
+    {
+        return -1;
+    }
+    extent *best = NULL;
+    extent *node = index->by_size;
+    while (node != NULL)
+    {
+        if (node->num_pages >= num_pages)
+        {
+            best = node;
+            node = node->child[BY_SIZE][0];
+        }
+        else
+        {
+            node = node->child[BY_SIZE][1];
+        }
+    }
+    if (best == NULL)
+    {
+        return -1;
+    }
+
+    long start = best->start;
+    remove_extent(index, best);
+    if (best->num_pages > num_pages)
+    {
+        best->start += num_pages;
+        best->num_pages -= num_pages;
+        insert_extent(index, best);
+    }
+    else
+    {
+        free(best);
+    }
+    index->free_pages -= num_pages;
+    return start;
+}
+
+/*
+ * Return a run of pages to the index, merged with the free runs right
+ * before and after it so that free space never fragments into touching runs.
+ */
+void put_free_extent(ExtentIndex *index, size_t start, size_t num_pages)
+{
+    if (num_pages == 0)
+    {
+        return;
+    }
+    index->free_pages += num_pages;
+
+    extent *before = floor_extent(index, start);
+    if (before != NULL && before->start + before->num_pages == start)
+    {
+        remove_extent(index, before);
+        start = before->start;
+        num_pages += before->num_pages;
+        free(before);
+    }
+    extent *after = ceiling_extent(index, start);
+    if (after != NULL && start + num_pages == after->start)
+    {
+        remove_extent(index, after);
+        num_pages += after->num_pages;
+        free(after);
+    }
+    insert_extent(index, new_extent(index, start, num_pages));
+}
+
+/*
+ * The smallest free run of the subtree that holds num_pages from a
+ * multiple of alignment, NULL if there is none.
+ */
+static extent *find_aligned_extent(extent *node, size_t num_pages, size_t alignment)
+{
+    if (node == NULL)
+    {
+        return NULL;
+    }
+    if (node->num_pages >= num_pages)
+    {
+        extent *smaller = find_aligned_extent(node->child[BY_SIZE][0], num_pages, alignment);
+        if (smaller != NULL)
+        {
+            return smaller;
+        }
+        size_t aligned_start = (node->start + alignment - 1) / alignment * alignment;
+        if (aligned_start + num_pages <= node->start + node->num_pages)
+        {
+            return node;
+        }
+    }
+    return find_aligned_extent(node->child[BY_SIZE][1], num_pages, alignment);
+}
+
+/*
+ * Best fit like get_free_extent(), for a run that starts at a multiple of
+ * alignment pages. The pages before and after it stay free.
+ * Returns the first page, or -1 if no run holds an aligned range that long.
+ */
+long get_free_extent_aligned(ExtentIndex *index, size_t num_pages, size_t alignment)
+{
+    if (num_pages == 0)
+    {
+        return -1;
+    }
+    extent *best = find_aligned_extent(index->by_size, num_pages, alignment);
+    if (best == NULL)
+    {
+        return -1;
+    }
+
+    size_t start = best->start;
+    size_t end = best->start + best->num_pages;
+    size_t aligned_start = (start + alignment - 1) / alignment * alignment;
+    remove_extent(index, best);
+    free(best);
+    index->free_pages -= end - start;
+    put_free_extent(index, start, aligned_start - start);
+    put_free_extent(index, aligned_start + num_pages, end - aligned_start - num_pages);
+    return aligned_start;
+}
+
+bool is_free_page(ExtentIndex *index, size_t page)
+{
+    extent *node = floor_extent(index, page);
+    return node != NULL && page < node->start + node->num_pages;
+}
@@ -0,0 +1,33 @@
+#ifndef EXTENT_H_INCLUDED
+#define EXTENT_H_INCLUDED
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// A run of free pages, kept in two treaps at once.
+typedef struct extent
+{
+    size_t start;          // First page of the run
+    size_t num_pages;      // Length of the run in pages
+    unsigned int priority; // Random heap priority, shared by both treaps
+
+    // child[tree][0] is the left child, child[tree][1] the right child
+    // in the address ordered (0) or size ordered (1) treap.
+    struct extent *child[2][2];
+} extent;
+
+typedef struct
+{
+    extent *by_address; // Free runs ordered by start page, to coalesce
+    extent *by_size;    // Free runs ordered by (num_pages, start), for best fit
+    size_t free_pages;  // Total number of free pages
+    unsigned int seed;  // State of the priority generator
+} ExtentIndex;
+
+ExtentIndex *init_extent_index(size_t first_page, size_t num_pages);
+void free_extent_index(ExtentIndex *index);
+long get_free_extent(ExtentIndex *index, size_t num_pages);
+long get_free_extent_aligned(ExtentIndex *index, size_t num_pages, size_t alignment);
+void put_free_extent(ExtentIndex *index, size_t start, size_t num_pages);
+bool is_free_page(ExtentIndex *index, size_t page);
+#endif
@@ -1,27 +1,71 @@
 
 #include "my_vm.h"
 #include "bitmap.h"
+#include "extent.h"
+#include "buddy.h"
+#include "slab.h"
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 void *physical_memory;
 
-CharBitmap *virtual_bitmap;
-CharBitmap *physical_bitmap;
+ExtentIndex *virtual_extents;
+BuddyAllocator *physical_frames;
 
-page_dir_entry *page_directory;
+#if SWAP
+static int swap_fd = -1;
+static CharBitmap *swap_bitmap; // swap slots in use
+static size_t *frame_owner;     // virtual page in each frame, 0 for free frames and page tables
+static size_t clock_hand;       // next frame the clock looks at
+#endif
 
-static unsigned int offset_bits;
-static unsigned int page_table_bits;
-static unsigned int page_dir_bits;
+page_dir_entry *page_directory; // the top level table
 
-static unsigned int tlb_misses;
-static unsigned int tlb_lookups;
+static unsigned int offset_bits;
+static unsigned int page_table_bits;                // bits of the index into a page table, the last level
+static unsigned int level_bits[PAGE_TABLE_LEVELS];  // bits of the index into a table of each level, top first
+static unsigned int level_shift[PAGE_TABLE_LEVELS]; // bits above that index in a padded virtual address
+
+// Every thread has its own TLBs and counters, so a lookup takes no lock.
+static __thread unsigned int tlb_misses;  // misses in every TLB level, these walk the page directory
+static __thread unsigned int tlb_lookups; // lookups of the TLB
+static __thread unsigned int l2_misses;   // misses of the TLB
+static __thread unsigned int huge_tlb_lookups; // lookups of the large page TLB
+static __thread unsigned int micro_tlb_misses;
+static __thread unsigned int micro_tlb_lookups;
+
+// Counters of threads that exited, added by the tlb_stats_key destructor.
+static unsigned long total_tlb_misses;
+static unsigned long total_tlb_lookups;
+static unsigned long total_l2_misses;
+static unsigned long total_micro_tlb_misses;
+static unsigned long total_micro_tlb_lookups;
+static unsigned long total_huge_tlb_lookups;
+static pthread_key_t tlb_stats_key;
+static pthread_once_t tlb_stats_once = PTHREAD_ONCE_INIT;
+static __thread bool tlb_stats_registered;
+
+// Shootdown: t_free bumps tlb_generation, a thread flushes its TLBs
+// on its next lookup if they were filled under an older generation.
+static volatile unsigned long tlb_generation;
+static __thread unsigned long tlb_seen_generation;
 
+/*
+ * Locking, always taken in this order:
+ * map_lock     allocator lock, the virtual extents and physical frames, the swap file.
+ * table_lock   the page directory and page tables. A TLB miss takes it
+ *              shared to walk, mapping and unmapping take it exclusive.
+ * general_lock the global TLB counters.
+ */
 static pthread_mutex_t general_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t memory_once = PTHREAD_ONCE_INIT;
 
-struct tlb tlb_store;
+static __thread struct tlb tlb_store;
+static __thread struct micro_tlb micro_tlb_store;
+static __thread struct huge_tlb huge_tlb_store;
 
 size_t top_bits(int num_top_bits, size_t va)
 {
@@ -30,8 +74,17 @@ size_t top_bits(int num_top_bits, size_t va)
 }
 size_t pad_virtual_address(void *va)
 {
-    // Pad a 64 bit virtual address to 32 bits.
-    return (size_t)va;
+    // Pad a virtual address of ADDRESS_SPACE bits to the width of size_t,
+    // so top_bits() reads the index of each level from the top.
+    return (size_t)va << (sizeof(size_t) * 8 - ADDRESS_SPACE);
+}
+
+/*
+ * Index of a padded virtual address into its table at a level, 0 is the top level.
+ */
+static size_t level_index(size_t virtual_address, int level)
+{
+    return top_bits(level_bits[level], virtual_address << level_shift[level]);
 }
 
 /*
@@ -49,50 +102,204 @@ void set_physical_mem()
 
     int virtual_bits = ADDRESS_SPACE - log2(PGSIZE);
 
-    size_t num_virtual_pages = (1 << virtual_bits); // 2^32 / 2^12 = 2^20
+    size_t num_virtual_pages = ((size_t)1 << virtual_bits); // 2^32 / 2^12 = 2^20
     size_t num_physical_pages = (MEMSIZE) / PGSIZE;
 
-    virtual_bitmap = init_bitmap(num_virtual_pages);
-    physical_bitmap = init_bitmap(num_physical_pages);
+    // the first virtual page is never handed out, so no allocation is at NULL.
+    virtual_extents = init_extent_index(1, num_virtual_pages - 1);
+    // frame 0 holds the page directory.
+    physical_frames = init_buddy(1, num_physical_pages);
 
     // calculate number of bits needed for each address.
-    int num_entries_in_page_directory = PGSIZE / sizeof(page_dir_entry);
+    // every level below the top resolves LEVEL_BITS, the top level the rest.
     offset_bits = (unsigned int)log2(PGSIZE);
-    page_dir_bits = log2(num_entries_in_page_directory);
-    page_table_bits = 32 - offset_bits - page_dir_bits;
+    page_table_bits = LEVEL_BITS;
+    level_bits[0] = virtual_bits - LEVEL_BITS * (PAGE_TABLE_LEVELS - 1);
+    level_shift[0] = 0;
+    for (int level = 1; level < PAGE_TABLE_LEVELS; ++level)
+    {
+        level_bits[level] = LEVEL_BITS;
+        level_shift[level] = level_shift[level - 1] + level_bits[level - 1];
+    }
 
+    // the tables below the top level are allocated when a page under them is mapped.
     page_directory = physical_memory;
-    for (int i = 0; i < num_entries_in_page_directory; ++i)
+    memset(page_directory, 0, PGSIZE);
+
+#if SWAP
+    // unlinked right away, the disk space goes back when the process exits.
+    swap_fd = open(SWAP_FILE, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (swap_fd == -1)
     {
-        page_directory[i].allocated_page = false;
-        page_directory[i].page_index_of_page_table = 0;
+        fprintf(stderr, "%s at line %d: failed to open swap file %s.\n", __func__, __LINE__, SWAP_FILE);
+        exit(1);
     }
+    unlink(SWAP_FILE);
+    swap_bitmap = init_bitmap(SWAP_PAGES);
+    frame_owner = calloc(num_physical_pages, sizeof(size_t));
+    if (frame_owner == NULL)
+    {
+        fprintf(stderr, "%s at line %d: failed to allocate frame owners.\n", __func__, __LINE__);
+        exit(1);
+    }
+#endif
+}
+
+/*
+ * Mark a way of the set as most recently used: every tree node on the
+ * path to it points the victim search to the other half.
+ */
+static void touch_TLB_way(struct tlb_set *set, int way)
+{
+    int node = 1, low = 0, span = TLB_WAYS;
+    while (span > 1)
+    {
+        span >>= 1;
+        if (way >= low + span)
+        {
+            set->plru &= ~(1UL << node);
+            low += span;
+            node = 2 * node + 1;
+        }
+        else
+        {
+            set->plru |= (1UL << node);
+            node = 2 * node;
+        }
+    }
+}
 
-    set_bit(physical_bitmap, 0);
-    set_bit(virtual_bitmap, 0);
+/*
+ * Pick the pseudo least recently used way by following the tree bits.
+ */
+static int victim_TLB_way(struct tlb_set *set)
+{
+    int node = 1, low = 0, span = TLB_WAYS;
+    while (span > 1)
+    {
+        span >>= 1;
+        if (set->plru & (1UL << node))
+        {
+            low += span;
+            node = 2 * node + 1;
+        }
+        else
+        {
+            node = 2 * node;
+        }
+    }
+    return low;
+}
+
+static void flush_TLB_stats(void *unused)
+{
+    pthread_mutex_lock(&general_lock);
+    total_tlb_misses += tlb_misses;
+    total_tlb_lookups += tlb_lookups;
+    total_l2_misses += l2_misses;
+    total_micro_tlb_misses += micro_tlb_misses;
+    total_micro_tlb_lookups += micro_tlb_lookups;
+    total_huge_tlb_lookups += huge_tlb_lookups;
+    tlb_misses = tlb_lookups = l2_misses = micro_tlb_misses = micro_tlb_lookups = huge_tlb_lookups = 0;
+    pthread_mutex_unlock(&general_lock);
+}
+
+static void create_TLB_stats_key()
+{
+    pthread_key_create(&tlb_stats_key, flush_TLB_stats);
+}
+
+/*
+ * Flush the TLBs of this thread if a page was freed since they were filled.
+ * Registers the thread so its counters survive its exit.
+ */
+static void sync_TLB()
+{
+    unsigned long generation = __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+    if (generation != tlb_seen_generation)
+    {
+        memset(&tlb_store, 0, sizeof(tlb_store));
+        memset(&micro_tlb_store, 0, sizeof(micro_tlb_store));
+        memset(&huge_tlb_store, 0, sizeof(huge_tlb_store));
+        tlb_seen_generation = generation;
+    }
+    if (!tlb_stats_registered)
+    {
+        // the destructor only runs for a non NULL value
+        pthread_once(&tlb_stats_once, create_TLB_stats_key);
+        pthread_setspecific(tlb_stats_key, &tlb_stats_registered);
+        tlb_stats_registered = true;
+    }
+}
+
+/*
+ * Put a translation in the micro-TLB, over the oldest entry.
+ */
+static void add_micro_TLB(unsigned long tag, unsigned long pa)
+{
+    int i = micro_tlb_store.next;
+    micro_tlb_store.entries[i].tag = tag;
+    micro_tlb_store.entries[i].physical_address = pa;
+    micro_tlb_store.entries[i].valid = true;
+    micro_tlb_store.next = (i + 1) % MICRO_TLB_ENTRIES;
 }
 
 /*
  * Part 2: Add a virtual to physical page translation to the TLB.
+ * pa is the address of the page frame backing the page of va.
  * Feel free to extend the function arguments or return type.
  */
 int add_TLB(void *va, void *pa)
 {
 
     /*Part 2 HINT: Add a virtual to physical page translation to the TLB */
-    unsigned long i;
     unsigned long tag;
+    int way = -1;
 
     // takes the top order bits from the virtual address
     tag = (unsigned long)va >> offset_bits;
-    i = tag % TLB_ENTRIES;
-    tlb_store.entries[i].tag = tag;
-    tlb_store.entries[i].physical_address = pa;
-    tlb_store.entries[i].valid = true;
-    // tlb_misses++;
+    struct tlb_set *set = &tlb_store.sets[tag % TLB_SETS];
+
+    // reuse the entry of this page or a free way, otherwise evict the pseudo-LRU way
+    for (int i = 0; i < TLB_WAYS; ++i)
+    {
+        if (set->entries[i].valid && set->entries[i].tag == tag)
+        {
+            way = i;
+            break;
+        }
+        if (!set->entries[i].valid && way == -1)
+        {
+            way = i;
+        }
+    }
+    if (way == -1)
+    {
+        way = victim_TLB_way(set);
+    }
+    set->entries[way].tag = tag;
+    set->entries[way].physical_address = (unsigned long)pa;
+    set->entries[way].valid = true;
+    touch_TLB_way(set, way);
+    add_micro_TLB(tag, (unsigned long)pa);
     return 0;
 }
 
+/*
+ * Add the translation of a large page, pa is the address of its first frame.
+ * The micro-TLB gets the page of va, the set associative TLB is left to small pages.
+ */
+static void add_huge_TLB(void *va, void *pa)
+{
+    unsigned long tag = (unsigned long)va >> offset_bits;
+    int i = huge_tlb_store.next;
+    huge_tlb_store.entries[i].tag = tag >> page_table_bits;
+    huge_tlb_store.entries[i].physical_address = (unsigned long)pa;
+    huge_tlb_store.entries[i].valid = true;
+    huge_tlb_store.next = (i + 1) % HUGE_TLB_ENTRIES;
+    add_micro_TLB(tag, (unsigned long)pa + (tag % HUGE_PAGE_FRAMES) * PGSIZE);
+}
+
 /*
  * Part 2: Check TLB for a valid translation.
  * Returns the physical page address.
@@ -102,16 +309,46 @@ void *check_TLB(void *va)
 {
 
     /* Part 2: TLB lookup code here */
-    unsigned long i;
     unsigned long tag;
 
     tag = (unsigned long)va >> offset_bits;
-    i = tag % TLB_ENTRIES;
+    sync_TLB();
+
+    // L1: a hot page resolves in a few compares
+    micro_tlb_lookups++;
+    for (int i = 0; i < MICRO_TLB_ENTRIES; ++i)
+    {
+        if (micro_tlb_store.entries[i].valid && micro_tlb_store.entries[i].tag == tag)
+        {
+            return (void *)micro_tlb_store.entries[i].physical_address;
+        }
+    }
+    micro_tlb_misses++;
 
+    // L2: the set associative TLB
+    struct tlb_set *set = &tlb_store.sets[tag % TLB_SETS];
     tlb_lookups++;
-    if (tlb_store.entries[i].valid && tlb_store.entries[i].tag == tag)
+    for (int i = 0; i < TLB_WAYS; ++i)
     {
-        return tlb_store.entries[i].physical_address;
+        if (set->entries[i].valid && set->entries[i].tag == tag)
+        {
+            touch_TLB_way(set, i);
+            add_micro_TLB(tag, set->entries[i].physical_address);
+            return (void *)set->entries[i].physical_address;
+        }
+    }
+    l2_misses++;
+
+    // L3: large pages, one entry covers HUGE_PAGE_FRAMES pages
+    huge_tlb_lookups++;
+    for (int i = 0; i < HUGE_TLB_ENTRIES; ++i)
+    {
+        if (huge_tlb_store.entries[i].valid && huge_tlb_store.entries[i].tag == tag >> page_table_bits)
+        {
+            unsigned long pa = huge_tlb_store.entries[i].physical_address + (tag % HUGE_PAGE_FRAMES) * PGSIZE;
+            add_micro_TLB(tag, pa);
+            return (void *)pa;
+        }
     }
     tlb_misses++;
     return NULL;
@@ -125,27 +362,31 @@ void print_TLB_missrate()
 {
     double miss_rate = 0;
 
+    // counters of the calling thread plus those of every thread that exited
+    pthread_mutex_lock(&general_lock);
+    unsigned long micro_lookups = total_micro_tlb_lookups + micro_tlb_lookups;
+    unsigned long micro_misses = total_micro_tlb_misses + micro_tlb_misses;
+    unsigned long l2_lookups = total_tlb_lookups + tlb_lookups;
+    unsigned long l2_miss_count = total_l2_misses + l2_misses;
+    unsigned long huge_lookups = total_huge_tlb_lookups + huge_tlb_lookups;
+    unsigned long huge_misses = total_tlb_misses + tlb_misses;
+    pthread_mutex_unlock(&general_lock);
+
     /*Part 2 Code here to calculate and print the TLB miss rate*/
-    if (tlb_lookups != 0)
-        miss_rate = (double)tlb_misses / tlb_lookups;
+    // every translation starts in the micro-TLB, only misses of all levels walk the page directory
+    if (micro_lookups != 0)
+        miss_rate = (double)huge_misses / micro_lookups;
     else
         miss_rate = 0.0;
+    fprintf(stderr, "L1 micro-TLB %d entries: %lu lookups, %lu misses\n",
+            MICRO_TLB_ENTRIES, micro_lookups, micro_misses);
+    fprintf(stderr, "L2 TLB %d entries, %d-way, %d sets: %lu lookups, %lu misses\n",
+            TLB_ENTRIES, TLB_WAYS, TLB_SETS, l2_lookups, l2_miss_count);
+    fprintf(stderr, "L3 large page TLB %d entries: %lu lookups, %lu misses\n",
+            HUGE_TLB_ENTRIES, huge_lookups, huge_misses);
     fprintf(stderr, "TLB miss rate %lf \n", miss_rate);
 }
 
-void invalidate_TLB(void *va)
-{
-    unsigned long tag;
-    unsigned long i;
-
-    tag = (unsigned long)va >> offset_bits;
-    i = tag % TLB_ENTRIES;
-    if (tlb_store.entries[i].valid && tlb_store.entries[i].tag == tag)
-    {
-        tlb_store.entries[i].valid = false;
-    }
-}
-
 /*
 The function takes a virtual address and page directories starting address and
 performs translation to return the physical address
@@ -158,86 +399,338 @@ performs translation to return the physical address
  * translation exists, then you can return physical address from the TLB.
  */
 
-// If translation not successful, then return NULL
-void *translate(void *va)
+/*
+ * Walk the directory levels to the entry of va in the last one, the entry
+ * that points to a page table or maps a large page.
+ * Returns NULL if a table on the way is missing. The caller holds table_lock.
+ */
+static page_dir_entry *walk_page_directory(void *va)
 {
     size_t virtual_address = pad_virtual_address(va);
 
-    size_t page_dir_index = top_bits(page_dir_bits, virtual_address);
-    size_t page_table_index = top_bits(page_table_bits, virtual_address << page_dir_bits);
-    size_t offset_index = top_bits(offset_bits, virtual_address << (page_dir_bits + page_table_bits));
+    page_dir_entry *table = page_directory;
+    for (int level = 0; level < PAGE_TABLE_LEVELS - 2; ++level)
+    {
+        page_dir_entry pg_dir_entry = table[level_index(virtual_address, level)];
+        if (pg_dir_entry.allocated_page == false)
+        {
+            return NULL;
+        }
+        table = (PGSIZE * pg_dir_entry.page_index_of_page_table) + physical_memory;
+    }
+    return &table[level_index(virtual_address, PAGE_TABLE_LEVELS - 2)];
+}
 
-    void *cached_physical_address = check_TLB(va);
-    if (cached_physical_address != NULL)
+/*
+ * The page table entry of va in the page table of a directory entry.
+ * Returns NULL if va is not mapped by a small page.
+ */
+static page_table_entry *lookup_page_table(page_dir_entry *pg_dir_entry, void *va)
+{
+    if (pg_dir_entry == NULL || pg_dir_entry->allocated_page == false || pg_dir_entry->huge)
     {
-        return cached_physical_address;
+        return NULL;
     }
 
-    page_dir_entry pg_dir_entry = page_directory[page_dir_index];
-    if (pg_dir_entry.allocated_page == false)
+    size_t page_table_index = level_index(pad_virtual_address(va), PAGE_TABLE_LEVELS - 1);
+    page_table_entry *page_table_address = (PGSIZE * pg_dir_entry->page_index_of_page_table) + physical_memory;
+    if (page_table_address[page_table_index].allocated_page == false)
     {
-        fprintf(stderr, "%s at line %d: failed to translate address\n", __func__, __LINE__);
         return NULL;
     }
+    return &page_table_address[page_table_index];
+}
 
-    page_table_entry *page_table_address = (PGSIZE * pg_dir_entry.page_index_of_page_table) + physical_memory;
-    page_table_entry pg_table_entry = page_table_address[page_table_index];
+/*
+ * Walk the page tables to the page table entry of va.
+ * Returns NULL if va is not mapped. The caller holds table_lock.
+ */
+static page_table_entry *walk_page_table(void *va)
+{
+    return lookup_page_table(walk_page_directory(va), va);
+}
 
-    if (pg_table_entry.allocated_page == false)
+/*
+ * Set the accessed bit of a page table entry. Walks share table_lock, so
+ * the bit is or'ed into the entry atomically instead of rewriting it.
+ */
+static void mark_accessed(page_table_entry *pg_table_entry)
+{
+    page_table_entry accessed_bit = {.accessed = true};
+    __atomic_fetch_or((unsigned int *)pg_table_entry, *(unsigned int *)&accessed_bit, __ATOMIC_RELAXED);
+}
+
+#if SWAP
+/*
+ * Clock (second chance) replacement: the hand sweeps the frames, a page
+ * accessed since the last sweep has its bit cleared and is passed over,
+ * the first one that was not is written to the swap file.
+ * Returns the freed frame, still marked in use, or -1 if nothing can be evicted.
+ * The caller holds map_lock and table_lock exclusive.
+ */
+static long evict_frame()
+{
+    size_t num_frames = physical_frames->num_frames;
+    for (size_t n = 0; n < 2 * num_frames; ++n)
     {
-        fprintf(stderr, "%s at line %d: failed to translate address\n", __func__, __LINE__);
-        return NULL;
+        size_t frame = clock_hand;
+        clock_hand = (clock_hand + 1) % num_frames;
+        if (clock_hand == 0)
+        {
+            // a TLB hit does not set the accessed bit: after every sweep the
+            // TLBs are flushed so the pages in use are walked and marked again.
+            __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_RELEASE);
+        }
+        if (frame_owner[frame] == 0)
+        {
+            continue;
+        }
+        page_table_entry *pg_table_entry = walk_page_table((void *)(frame_owner[frame] * PGSIZE));
+        if (pg_table_entry->accessed)
+        {
+            pg_table_entry->accessed = false;
+            continue;
+        }
+
+        int slot = get_free_bit(swap_bitmap);
+        if (slot == -1)
+        {
+            fprintf(stderr, "%s at line %d: swap file is full\n", __func__, __LINE__);
+            return -1;
+        }
+        void *frame_address = physical_memory + (frame * PGSIZE);
+        if (pwrite(swap_fd, frame_address, PGSIZE, (off_t)slot * PGSIZE) != PGSIZE)
+        {
+            fprintf(stderr, "%s at line %d: failed to write swap slot %d\n", __func__, __LINE__, slot);
+            return -1;
+        }
+        set_bit(swap_bitmap, slot);
+        pg_table_entry->swapped = true;
+        pg_table_entry->page_frame_index = slot;
+        frame_owner[frame] = 0;
+
+        // shootdown: the frame gets a new page, no thread may use the old translation
+        __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_RELEASE);
+        return frame;
     }
-    void *page_frame_address = (PGSIZE * pg_table_entry.page_frame_index) + physical_memory;
-    void *physical_address = page_frame_address + offset_index;
+    return -1;
+}
+#endif
 
-    add_TLB(va, physical_address);
+/*
+ * One frame for a page or a page table, evicting a page when none is free.
+ * Returns -1 if physical memory is full. The caller holds map_lock.
+ */
+static long allocate_frame()
+{
+    long frame = get_free_block(physical_frames, 0);
+#if SWAP
+    if (frame == -1)
+    {
+        pthread_rwlock_wrlock(&table_lock);
+        frame = evict_frame();
+        pthread_rwlock_unlock(&table_lock);
+    }
+#endif
+    return frame;
+}
 
-    return physical_address;
+#if SWAP
+/*
+ * Read a swapped out page back into a frame. The caller holds map_lock.
+ */
+static bool swap_in_page(page_table_entry *pg_table_entry, size_t virtual_page)
+{
+    long frame = allocate_frame();
+    if (frame == -1)
+    {
+        return false;
+    }
+    // eviction only moves other pages: the entry is still swapped
+    size_t slot = pg_table_entry->page_frame_index;
+    void *frame_address = physical_memory + (frame * PGSIZE);
+    if (pread(swap_fd, frame_address, PGSIZE, (off_t)slot * PGSIZE) != PGSIZE)
+    {
+        fprintf(stderr, "%s at line %d: failed to read swap slot %zu\n", __func__, __LINE__, slot);
+        put_free_block(physical_frames, frame, 0);
+        return false;
+    }
+    frame_owner[frame] = virtual_page;
+    clear_bit(swap_bitmap, slot);
+
+    pthread_rwlock_wrlock(&table_lock);
+    pg_table_entry->page_frame_index = frame;
+    pg_table_entry->swapped = false;
+    pg_table_entry->accessed = true;
+    pthread_rwlock_unlock(&table_lock);
+    return true;
 }
+#endif
 
+#if DEMAND_PAGING || SWAP
 /*
-The function takes a page directory address, virtual address, physical address
-as an argument, and sets a page table entry. This function will walk the page
-directory to see if there is an existing mapping for a virtual address. If the
-virtual address is not present, then a new entry will be added
-*/
-int page_map(void *va, void *pa)
+ * Page fault on va: the first touch of a page t_malloc only reserved gets
+ * a zero filled frame, a swapped out page is read back from the swap file.
+ * Returns false if va was never allocated or no frame is left.
+ */
+static bool handle_page_fault(void *va)
+{
+    size_t virtual_page = (size_t)va >> offset_bits;
+
+    // every writer of the page tables holds map_lock, so they can be read here.
+    pthread_mutex_lock(&map_lock);
+    page_table_entry *pg_table_entry = walk_page_table(va);
+    bool mapped = pg_table_entry != NULL;
+#if DEMAND_PAGING
+    // reserved pages are the ones no longer in the free extents, page 0 is never handed out.
+    if (pg_table_entry == NULL && virtual_page != 0 && !is_free_page(virtual_extents, virtual_page))
+    {
+        long frame = allocate_frame();
+        if (frame != -1)
+        {
+            void *physical_page_address = physical_memory + (frame * PGSIZE);
+            memset(physical_page_address, 0, PGSIZE);
+            mapped = page_map((void *)(virtual_page * PGSIZE), physical_page_address) == 0;
+        }
+    }
+#endif
+#if SWAP
+    if (pg_table_entry != NULL && pg_table_entry->swapped)
+    {
+        mapped = swap_in_page(pg_table_entry, virtual_page);
+    }
+#endif
+    pthread_mutex_unlock(&map_lock);
+    return mapped;
+}
+#endif
+
+// If translation not successful, then return NULL
+void *translate(void *va)
 {
     size_t virtual_address = pad_virtual_address(va);
 
-    size_t page_dir_index = top_bits(page_dir_bits, virtual_address);
-    size_t page_table_index = top_bits(page_table_bits, virtual_address << page_dir_bits);
-    size_t offset_index = top_bits(offset_bits, virtual_address << (page_dir_bits + page_table_bits));
+    size_t offset_index = top_bits(offset_bits, virtual_address << (ADDRESS_SPACE - offset_bits));
 
-    page_dir_entry pg_dir_entry = page_directory[page_dir_index];
-    page_table_entry *page_table_address;
-    if (pg_dir_entry.allocated_page == false)
+    // the TLB caches the page frame, not the address within it
+    void *cached_page_frame = check_TLB(va);
+    if (cached_page_frame != NULL)
     {
-        // allocating the page table.
-        // page table takes one page of the physical memory.
+        return cached_page_frame + offset_index;
+    }
 
-        pg_dir_entry.allocated_page = true;
-        int free_page_number = get_free_bit(physical_bitmap);
-        pg_dir_entry.page_index_of_page_table = free_page_number;
+    // only a TLB miss needs the lock, walks of several threads run concurrently
+    pthread_rwlock_rdlock(&table_lock);
 
-        page_directory[page_dir_index] = pg_dir_entry;
+    // a large page is mapped by the directory entry, the walk stops a level early
+    page_dir_entry *pg_dir_entry = walk_page_directory(va);
+    if (pg_dir_entry != NULL && pg_dir_entry->allocated_page && pg_dir_entry->huge)
+    {
+        void *huge_page_address = (PGSIZE * pg_dir_entry->page_index_of_page_table) + physical_memory;
+        pthread_rwlock_unlock(&table_lock);
+        add_huge_TLB(va, huge_page_address);
+        return huge_page_address + ((size_t)va % HUGE_PGSIZE);
+    }
 
-        page_table_address = (PGSIZE * free_page_number) + physical_memory;
-        int num_entries_in_page_table = PGSIZE / sizeof(page_table_entry);
+    page_table_entry *pg_table_entry = lookup_page_table(pg_dir_entry, va);
+#if DEMAND_PAGING || SWAP
+    // a page fault maps the page, which can be evicted again before the next walk
+    while (pg_table_entry == NULL || pg_table_entry->swapped)
+    {
+        pthread_rwlock_unlock(&table_lock);
+        bool mapped = handle_page_fault(va);
+        pthread_rwlock_rdlock(&table_lock);
+        if (!mapped)
+        {
+            pg_table_entry = NULL;
+            break;
+        }
+        pg_table_entry = walk_page_table(va);
+    }
+#endif
+    if (pg_table_entry == NULL)
+    {
+        pthread_rwlock_unlock(&table_lock);
+        fprintf(stderr, "%s at line %d: failed to translate address\n", __func__, __LINE__);
+        return NULL;
+    }
+    if (!pg_table_entry->accessed)
+    {
+        mark_accessed(pg_table_entry);
+    }
+    void *page_frame_address = (PGSIZE * pg_table_entry->page_frame_index) + physical_memory;
+    pthread_rwlock_unlock(&table_lock);
+
+    void *physical_address = page_frame_address + offset_index;
 
-        for (int i = 0; i < num_entries_in_page_table; ++i)
+    add_TLB(va, page_frame_address);
+
+    return physical_address;
+}
+
+/*
+ * Allocate a zero filled table for a directory entry and link it in, every
+ * entry of the new table is unallocated. The caller holds map_lock but not
+ * table_lock, the frame may take an eviction.
+ */
+static bool allocate_table(page_dir_entry *pg_dir_entry)
+{
+    long frame = allocate_frame();
+    if (frame == -1)
+    {
+        return false;
+    }
+    memset(physical_memory + (frame * PGSIZE), 0, PGSIZE);
+
+    pthread_rwlock_wrlock(&table_lock);
+    pg_dir_entry->page_index_of_page_table = frame;
+    pg_dir_entry->allocated_page = true;
+    pthread_rwlock_unlock(&table_lock);
+    return true;
+}
+
+/*
+ * Like walk_page_directory(), allocating the tables missing on the way.
+ * Returns NULL if physical memory is full. The caller holds map_lock.
+ */
+static page_dir_entry *map_page_directory(void *va)
+{
+    size_t virtual_address = pad_virtual_address(va);
+
+    page_dir_entry *table = page_directory;
+    for (int level = 0; level < PAGE_TABLE_LEVELS - 2; ++level)
+    {
+        page_dir_entry *pg_dir_entry = &table[level_index(virtual_address, level)];
+        if (pg_dir_entry->allocated_page == false && !allocate_table(pg_dir_entry))
         {
-            page_table_address[i].allocated_page = false;
-            page_table_address[i].page_frame_index = 0;
+            return NULL;
         }
-        // printf("physical_bitmap:free_page_number: %d\n", free_page_number);
-        set_bit(physical_bitmap, free_page_number);
+        table = (PGSIZE * pg_dir_entry->page_index_of_page_table) + physical_memory;
     }
-    else
+    return &table[level_index(virtual_address, PAGE_TABLE_LEVELS - 2)];
+}
+
+/*
+The function takes a page directory address, virtual address, physical address
+as an argument, and sets a page table entry. This function will walk the page
+directory to see if there is an existing mapping for a virtual address. If the
+virtual address is not present, then a new entry will be added.
+The caller holds map_lock, a new page table takes a physical page.
+*/
+int page_map(void *va, void *pa)
+{
+    size_t page_table_index = level_index(pad_virtual_address(va), PAGE_TABLE_LEVELS - 1);
+
+    // the tables on the way and the page table are allocated
+    // before table_lock is taken, since a new one may evict a page.
+    page_dir_entry *pg_dir_entry = map_page_directory(va);
+    if (pg_dir_entry == NULL || (pg_dir_entry->allocated_page == false && !allocate_table(pg_dir_entry)))
     {
-        page_table_address = (PGSIZE * pg_dir_entry.page_index_of_page_table) + physical_memory;
+        return -1;
     }
+    page_table_entry *page_table_address = (PGSIZE * pg_dir_entry->page_index_of_page_table) + physical_memory;
+
+    pthread_rwlock_wrlock(&table_lock);
     page_table_entry pg_table_entry = page_table_address[page_table_index];
     if (pg_table_entry.allocated_page == false)
     {
@@ -250,99 +743,98 @@ int page_map(void *va, void *pa)
 
         page_table_address[page_table_index] = pg_table_entry;
 
-        set_bit(physical_bitmap, physical_page_number);
+#if SWAP
+        frame_owner[physical_page_number] = (size_t)va >> offset_bits;
+#endif
     }
+    pthread_rwlock_unlock(&table_lock);
     // add_TLB(va, pa);
     return 0;
 }
 
 /*Function that gets the next available page
+ * Reserves num_pages contiguous virtual pages, best fit from the free extents.
+ * The caller holds map_lock.
  */
 void *get_next_avail(int num_pages)
 {
-    size_t start_page_num = 0;
-    size_t end_page_num = 0;
-
-    int examine_bytes = num_pages < 15 ? 0 : ((num_pages + 1) / 8) - 1;
-    // 15 >= free bits
-    // num_pages = 15, examine_bytes = 1
-    // virtual_bitmap->size = 16
-    // 2
-    size_t num_bytes = virtual_bitmap->size / 8;
-
-    // bool found_consecutive_examine_bytes = fals
-    // num_bytes = 4;
-    // examine_bytes = 2;
-    // 4 - 2 = 2
-    for (size_t i = 1; i < num_bytes - examine_bytes; ++i)
-    {
-        bool continues_examine_byte = true;
-        for (size_t j = 0; j < examine_bytes; j++)
-        {
-            // examine_bytes = 2
-            // i = 1, j = 0  = 1
-            // i = 1, j = 1 = 2
-            if (virtual_bitmap->data[i + j] != 0)
-            {
-                continues_examine_byte = false;
-                break;
-            }
-        }
-        if (!continues_examine_byte)
+    long start_page_num = get_free_extent(virtual_extents, num_pages);
+    if (start_page_num < 0)
+    {
+        return NULL;
+    }
+    return (void *)(start_page_num * PGSIZE);
+}
+
+/*
+ * Give back the frames of a large page and clear its directory entry.
+ * The caller holds map_lock and table_lock exclusive.
+ */
+static void release_huge_page(page_dir_entry *pg_dir_entry)
+{
+    size_t first_frame = pg_dir_entry->page_index_of_page_table;
+    put_free_block(physical_frames, first_frame, __builtin_ctzl(HUGE_PAGE_FRAMES));
+    pg_dir_entry->allocated_page = false;
+    pg_dir_entry->huge = false;
+    pg_dir_entry->page_index_of_page_table = 0;
+}
+
+/*
+ * Give back the frame of a page, or its swap slot if it is swapped out.
+ * The caller holds map_lock and table_lock exclusive.
+ */
+static void release_page(page_table_entry *pg_table_entry)
+{
+#if SWAP
+    if (pg_table_entry->swapped)
+    {
+        clear_bit(swap_bitmap, pg_table_entry->page_frame_index);
+        return;
+    }
+    frame_owner[pg_table_entry->page_frame_index] = 0;
+#endif
+    put_free_block(physical_frames, pg_table_entry->page_frame_index, 0);
+}
+
+/*
+ * Give back the frames of num_pages mapped pages from va and clear their
+ * entries, large pages go back whole. The virtual range is left to the caller.
+ * The caller holds map_lock and table_lock exclusive.
+ */
+static void unmap_pages(void *va, size_t num_pages)
+{
+    for (size_t i = 0; i < num_pages; i++)
+    {
+        void *curr_virtual_address = va + (i * PGSIZE);
+
+        // a large page goes back whole, the range starts at its first page
+        page_dir_entry *pg_dir_entry = walk_page_directory(curr_virtual_address);
+        if (pg_dir_entry != NULL && pg_dir_entry->allocated_page && pg_dir_entry->huge)
         {
+            release_huge_page(pg_dir_entry);
+            i += HUGE_PAGE_FRAMES - 1;
             continue;
         }
-        char leftByte = virtual_bitmap->data[i - 1];
-        char rightByte = virtual_bitmap->data[i + examine_bytes];
 
-        start_page_num = (8 * i);
-        end_page_num = 8 * (i + examine_bytes);
-        // go from right to left
-        // 0000 0000 | 0000 0000 0000 0000 | 0000 0000
-        // 0000 0001
-        for (int k = 0; k < 8; k++)
+        page_table_entry *pg_table_entry = walk_page_table(curr_virtual_address);
+#if DEMAND_PAGING
+        // a page that was never touched has no frame to free.
+        if (pg_table_entry == NULL)
         {
-            int mask = 1 << k;
-            int bit = (rightByte & mask) != 0;
-            if (bit)
-            {
-                break;
-            }
-            else
-            {
-                end_page_num++;
-            }
-        }
-        // go from left to right
-        for (int k = 7; k >= 0; k--)
-        {
-            int mask = 1 << k;
-            int bit = (leftByte & mask) != 0;
-            if (bit)
-            {
-                break;
-            }
-            else
-            {
-                start_page_num--;
-            }
-        }
-        if (end_page_num - start_page_num >= num_pages)
-        {
-            break;
+            continue;
         }
-    }
-    if (end_page_num - start_page_num >= num_pages)
-    {
-        for (int j = start_page_num; j < (start_page_num + num_pages); j++)
+#endif
+        if (pg_table_entry == NULL)
         {
-            set_bit(virtual_bitmap, j);
+            fprintf(stderr, "%s at line %d: physical address translation failed.", __func__, __LINE__);
+            exit(1);
         }
-        return start_page_num * PGSIZE;
-    }
-    else
-    {
-        return NULL;
+        release_page(pg_table_entry);
+
+        pg_table_entry->allocated_page = false;
+        pg_table_entry->page_frame_index = 0;
+        pg_table_entry->accessed = false;
+        pg_table_entry->swapped = false;
     }
 }
 
@@ -358,84 +850,264 @@ and used by the benchmark
  * free pages are available, set the bitmaps and map a new page. Note, you will
  * have to mark which physical pages are used.
  */
-void *t_malloc(unsigned int num_bytes)
+void *t_malloc_pages(unsigned int num_pages)
 {
-    static int memory_init = 0;
-    pthread_mutex_lock(&general_lock);
-    if (!memory_init)
-    {
-        set_physical_mem();
-        memory_init = 1;
-    }
+    pthread_once(&memory_once, set_physical_mem);
 
-    size_t num_pages = (num_bytes / PGSIZE) + 1;
+    // the page tables stay readable by translate() in other threads,
+    // page_map() only locks them out while it writes an entry.
+    pthread_mutex_lock(&map_lock);
     void *start_virtual_address_page = get_next_avail(num_pages);
     if (!start_virtual_address_page)
     {
-        pthread_mutex_unlock(&general_lock);
+        pthread_mutex_unlock(&map_lock);
         return NULL;
     }
-
-    for (size_t i = 0; i < num_pages; i++)
+#if DEMAND_PAGING
+    // frames are mapped by translate() when a page is first touched.
+    pthread_mutex_unlock(&map_lock);
+    return start_virtual_address_page;
+#endif
+
+    // contiguous frames from the buddy allocator when there is a large enough
+    // block, one frame at a time otherwise.
+    long first_frame = get_free_frames(physical_frames, num_pages);
+    long free_bit_page_num = -1;
+    long i;
+    for (i = 0; i < (long)num_pages; i++)
     {
-        int free_bit_page_num = get_free_bit(physical_bitmap);
+        free_bit_page_num = first_frame != -1 ? first_frame + i : allocate_frame();
+        if (free_bit_page_num == -1)
+        {
+            fprintf(stderr, "%s at line %d: out of physical memory\n", __func__, __LINE__);
+            goto fail;
+        }
 
         void *physical_page_address = physical_memory + (free_bit_page_num * PGSIZE);
         void *virtual_page_address = start_virtual_address_page + (i * PGSIZE);
 
-        set_bit(physical_bitmap, free_bit_page_num);
-
         int page_map_status = page_map(virtual_page_address, physical_page_address);
         if (page_map_status != 0)
         {
-            fprintf(stderr, "%s at line %d: failed to map virtual address to physical address", __func__, __LINE__);
-            pthread_mutex_unlock(&general_lock);
-            return NULL;
+            fprintf(stderr, "%s at line %d: failed to map virtual address to physical address\n", __func__, __LINE__);
+            goto fail;
         }
         // printf("Malloc virtual %p and physical %p\n", virtual_page_address, physical_page_address);
     }
-    pthread_mutex_unlock(&general_lock);
+    pthread_mutex_unlock(&map_lock);
     return start_virtual_address_page;
+
+fail:
+    // undo the pages mapped so far and give back the frames and the virtual
+    // range, so a failed request does not leak memory for the next one.
+    pthread_rwlock_wrlock(&table_lock);
+    unmap_pages(start_virtual_address_page, i);
+    pthread_rwlock_unlock(&table_lock);
+    if (first_frame != -1)
+    {
+        // the frames of the block that were not mapped, the failed one included
+        for (long frame = first_frame + i; frame < first_frame + (long)num_pages; ++frame)
+        {
+            put_free_block(physical_frames, frame, 0);
+        }
+    }
+    else if (free_bit_page_num != -1)
+    {
+        // the frame page_map() could not map
+        put_free_block(physical_frames, free_bit_page_num, 0);
+    }
+    put_free_extent(virtual_extents, (size_t)start_virtual_address_page >> offset_bits, num_pages);
+    pthread_mutex_unlock(&map_lock);
+    return NULL;
+}
+
+/*
+ * Allocate num_bytes, rounded up to whole large pages of HUGE_PGSIZE.
+ * Each large page is a directory entry mapping HUGE_PAGE_FRAMES contiguous
+ * frames, so it takes a single TLB entry. Large pages are never evicted.
+ * Returns NULL if there is no aligned virtual range or no free block of frames.
+ */
+void *t_malloc_huge(unsigned int num_bytes)
+{
+    pthread_once(&memory_once, set_physical_mem);
+
+    size_t num_huge_pages = (num_bytes + HUGE_PGSIZE - 1) / HUGE_PGSIZE;
+    pthread_mutex_lock(&map_lock);
+    long start_page = get_free_extent_aligned(virtual_extents, num_huge_pages * HUGE_PAGE_FRAMES, HUGE_PAGE_FRAMES);
+    if (start_page < 0)
+    {
+        pthread_mutex_unlock(&map_lock);
+        return NULL;
+    }
+    void *start_virtual_address = (void *)(start_page * PGSIZE);
+
+    for (size_t i = 0; i < num_huge_pages; i++)
+    {
+        page_dir_entry *pg_dir_entry = map_page_directory(start_virtual_address + i * HUGE_PGSIZE);
+        long first_frame = pg_dir_entry != NULL ? get_free_block(physical_frames, __builtin_ctzl(HUGE_PAGE_FRAMES)) : -1;
+
+        pthread_rwlock_wrlock(&table_lock);
+        if (first_frame == -1)
+        {
+            // undo the large pages mapped so far
+            for (size_t j = 0; j < i; j++)
+            {
+                release_huge_page(walk_page_directory(start_virtual_address + j * HUGE_PGSIZE));
+            }
+            put_free_extent(virtual_extents, start_page, num_huge_pages * HUGE_PAGE_FRAMES);
+            __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_RELEASE);
+            pthread_rwlock_unlock(&table_lock);
+            pthread_mutex_unlock(&map_lock);
+            return NULL;
+        }
+        if (pg_dir_entry->allocated_page)
+        {
+            // a page table left from small pages: every page of the range is free, so it is empty
+            size_t page_table_frame = pg_dir_entry->page_index_of_page_table;
+            put_free_block(physical_frames, page_table_frame, 0);
+        }
+        pg_dir_entry->page_index_of_page_table = first_frame;
+        pg_dir_entry->allocated_page = true;
+        pg_dir_entry->huge = true;
+        pthread_rwlock_unlock(&table_lock);
+    }
+    pthread_mutex_unlock(&map_lock);
+    return start_virtual_address;
+}
+
+void *t_malloc(unsigned int num_bytes)
+{
+    // small objects share pages, larger ones get exactly the pages they cover.
+    if (num_bytes <= SLAB_MAX_SIZE)
+    {
+        return slab_malloc(num_bytes);
+    }
+    // whole large pages when the size is a multiple of one, small pages if none are left.
+    // large pages are mapped at once, so demand paging keeps small pages unless asked.
+    if (!DEMAND_PAGING && num_bytes % HUGE_PGSIZE == 0)
+    {
+        void *va = t_malloc_huge(num_bytes);
+        if (va != NULL)
+        {
+            return va;
+        }
+    }
+    return t_malloc_pages((num_bytes + PGSIZE - 1) / PGSIZE);
 }
 
 /* Responsible for releasing one or more memory pages using virtual address (va)
  */
-void t_free(void *va, int size)
+void t_free_pages(void *va, unsigned int num_pages)
 {
-    pthread_mutex_lock(&general_lock);
-    size_t num_pages = (size / PGSIZE) + 1;
-    size_t virtual_address = pad_virtual_address(va);
+    pthread_mutex_lock(&map_lock);
+    pthread_rwlock_wrlock(&table_lock);
 
-    size_t page_dir_index = top_bits(page_dir_bits, virtual_address);
-    size_t page_table_index = top_bits(page_table_bits, virtual_address << page_dir_bits);
+    unmap_pages(va, num_pages);
 
-    size_t virtual_page_index = page_dir_index + page_table_index;
+    // the freed range merges with the free extents around it
+    put_free_extent(virtual_extents, (size_t)va >> offset_bits, num_pages);
 
-    page_dir_entry pg_dir_entry = page_directory[page_dir_index];
+    // shootdown: every thread drops its cached translations before its next lookup
+    __atomic_add_fetch(&tlb_generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&table_lock);
+    pthread_mutex_unlock(&map_lock);
+}
 
-    page_table_entry *page_table_address = (PGSIZE * pg_dir_entry.page_index_of_page_table) + physical_memory;
-    page_table_entry pg_table_entry = page_table_address[page_table_index];
+void t_free(void *va, int size)
+{
+    if (size <= SLAB_MAX_SIZE)
+    {
+        slab_free(va, size);
+        return;
+    }
+    t_free_pages(va, (size + PGSIZE - 1) / PGSIZE);
+}
+
+#if SWAP
+/*
+ * Keep the frames translated since tlb_generation read generation from
+ * being evicted until unpin_pages(). Eviction holds table_lock exclusive
+ * and bumps tlb_generation: if the generation has not moved once
+ * table_lock is held shared, the translations stay valid until it is released.
+ * Returns false if they have to be made again.
+ */
+static bool pin_pages(unsigned long generation)
+{
+    pthread_rwlock_rdlock(&table_lock);
+    if (__atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE) == generation)
+    {
+        return true;
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return false;
+}
 
-    pg_table_entry.allocated_page = false;
-    pg_table_entry.page_frame_index = 0;
+static void unpin_pages()
+{
+    pthread_rwlock_unlock(&table_lock);
+}
+#else
+// without swapping a frame stays with its page until t_free
+#define pin_pages(generation) ((void)(generation), true)
+#define unpin_pages()
+#endif
 
-    for (size_t i = 0; i < num_pages; i++)
+/*
+ * Translate the pages of [va, va + len) from the first one on, as long as
+ * their frames follow each other. Returns the length of that physically
+ * contiguous run, its physical address in *pa, or 0 if va is not mapped.
+ */
+static size_t map_run(void *va, size_t len, void **pa)
+{
+    *pa = translate(va);
+    if (*pa == NULL)
     {
-        size_t virtual_page_position = virtual_page_index + i;
+        return 0;
+    }
+    size_t run = PGSIZE - ((size_t)va % PGSIZE);
+    while (run < len && translate(va + run) == *pa + run)
+    {
+        run += PGSIZE;
+    }
+    return run < len ? run : len;
+}
 
-        void *curr_virtual_address = va + (i * PGSIZE);
-        void *curr_physical_address = translate(curr_virtual_address);
-        if (curr_physical_address == NULL)
+/*
+ * Copy len bytes between virtual memory at va and buf, into virtual memory
+ * if to_vm. One memcpy per run of contiguous frames, a large page or the
+ * frames of one buddy block take a single one.
+ * Returns -1 if a page of the range is not mapped.
+ */
+static int copy_pages(void *va, void *buf, size_t len, bool to_vm)
+{
+    // no lock: translate() resolves pages from this thread's TLBs,
+    // with swapping a run is only pinned while it is copied
+    while (len > 0)
+    {
+        void *pa;
+        size_t run;
+        unsigned long generation;
+        do
         {
-            fprintf(stderr, "%s at line %d: physical address translation failed.", __func__, __LINE__);
-            exit(1);
-        }
-        int physical_page_number = ((size_t)curr_physical_address - (size_t)physical_memory) / PGSIZE;
-        invalidate_TLB(curr_virtual_address);
-        clear_bit(virtual_bitmap, virtual_page_position);
-        clear_bit(physical_bitmap, physical_page_number);
+            generation = __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+            run = map_run(va, len, &pa);
+            if (run == 0)
+            {
+                fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
+                return -1;
+            }
+        } while (!pin_pages(generation));
+
+        if (to_vm)
+            memcpy(pa, buf, run);
+        else
+            memcpy(buf, pa, run);
+        unpin_pages();
+        va += run;
+        buf += run;
+        len -= run;
     }
-    pthread_mutex_unlock(&general_lock);
+    return 0;
 }
 
 /*
@@ -444,134 +1116,235 @@ void t_free(void *va, int size)
  */
 int put_value(void *va, void *src, int size)
 {
-    pthread_mutex_lock(&general_lock);
-    // remaining number of bytes to be copied
-    size_t remaining_bytes = size;
+    return copy_pages(va, src, size, true);
+}
 
-    // initialize current virtual address, current source address, current physical address
-    void *cur_va = va;
-    void *cur_src = src;
-    void *cur_pa = translate(cur_va);
-    if (cur_pa == NULL)
-    {
-        fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
-        pthread_mutex_unlock(&general_lock);
-        return -1;
-    }
-    // do first page
-    // number of bytes to be copied to first page
-    size_t bytes_to_copy = PGSIZE - ((size_t)va % PGSIZE);
-    if (size < bytes_to_copy)
-    {
-        memcpy(cur_pa, cur_src, size);
-        pthread_mutex_unlock(&general_lock);
-        return 0;
-    }
-    memcpy(cur_pa, cur_src, bytes_to_copy);
-    cur_va += bytes_to_copy;
-    cur_src += bytes_to_copy;
-    remaining_bytes -= bytes_to_copy;
+/*
+ * Given a virtual address, this function copies (size) bytes from the page
+ * to val
+ */
+void get_value(void *va, void *src, int size)
+{
+    copy_pages(va, src, size, false);
+}
 
-    // copy all middle pages
-    while (remaining_bytes >= PGSIZE)
+/*
+ * Gather: copy each iov[i].len bytes from iov[i].buf to virtual address iov[i].va.
+ * Returns -1 if a page of a range is not mapped, the vectors before it are copied.
+ */
+int put_values(const vm_iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; ++i)
     {
-        cur_pa = translate(cur_va);
-        if (cur_pa == NULL)
+        if (copy_pages(iov[i].va, iov[i].buf, iov[i].len, true) != 0)
         {
-            fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
-            pthread_mutex_unlock(&general_lock);
             return -1;
         }
-        memcpy(cur_pa, cur_src, PGSIZE);
-        cur_va += PGSIZE;
-        cur_src += PGSIZE;
-        remaining_bytes -= PGSIZE;
     }
-    if (remaining_bytes > 0)
+    return 0;
+}
+
+/*
+ * Scatter: copy each iov[i].len bytes from virtual address iov[i].va to iov[i].buf.
+ */
+int get_values(const vm_iovec *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; ++i)
     {
-        // do last page
-        cur_pa = translate(cur_va);
-        if (cur_pa == NULL)
+        if (copy_pages(iov[i].va, iov[i].buf, iov[i].len, false) != 0)
         {
-            fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
-            pthread_mutex_unlock(&general_lock);
             return -1;
         }
-        memcpy(cur_pa, cur_src, remaining_bytes);
     }
-    pthread_mutex_unlock(&general_lock);
     return 0;
 }
 
 /*
- * Given a virtual address, this function copies (size) bytes from the page
- * to val
+ * Copy n bytes from va_src to va_dst within virtual memory, without a
+ * buffer in between. Like memcpy the ranges must not overlap.
+ * Returns -1 if a page of either range is not mapped.
  */
-void get_value(void *va, void *src, int size)
+int vm_copy(void *va_dst, void *va_src, size_t n)
 {
-    pthread_mutex_lock(&general_lock);
-    // remaining number of bytes to be copied
-    size_t remaining_bytes = size;
-
-    // initialize current virtual address, current source address, current physical address
-    void *cur_va = va;
-    void *cur_src = src;
-    void *cur_pa = translate(cur_va);
-    if (cur_pa == NULL)
+    while (n > 0)
     {
-        fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
-        pthread_mutex_unlock(&general_lock);
-        return;
+        void *src_pa, *dst_pa;
+        size_t run;
+        unsigned long generation;
+        do
+        {
+            // the run is contiguous in both ranges
+            generation = __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+            run = map_run(va_src, n, &src_pa);
+            if (run != 0)
+            {
+                run = map_run(va_dst, run, &dst_pa);
+            }
+            if (run == 0)
+            {
+                fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
+                return -1;
+            }
+        } while (!pin_pages(generation));
+
+        memcpy(dst_pa, src_pa, run);
+        unpin_pages();
+        va_dst += run;
+        va_src += run;
+        n -= run;
     }
-    // do first page
-    // number of bytes to be copied to first page
-    size_t bytes_to_copy = PGSIZE - ((size_t)va % PGSIZE);
-    if (size < bytes_to_copy)
+    return 0;
+}
+
+/*
+This function receives two matrices mat1 and mat2 as an argument with size
+argument representing the number of rows and columns. After performing matrix
+multiplication, copy the result to answer.
+*/
+typedef unsigned int vec4u __attribute__((vector_size(16)));
+
+_Static_assert(MAT_TILE % 4 == 0, "MAT_TILE must be a multiple of 4");
+
+// Tile rows of the answer one thread of mat_mult_threads() computes
+struct mat_mult_work
+{
+    void *mat1;
+    void *mat2;
+    void *answer;
+    int size;
+    int first_row; // first row of the band, a multiple of MAT_TILE
+    int last_row;  // row past the band
+    int status;    // -1 if a tile of the band is not mapped
+};
+
+/*
+ * Copy the rows x cols tile at (row, col) of a size x size matrix between
+ * virtual memory and tile, whose rows are MAT_TILE ints apart. Each row of
+ * the tile is one vector of a single scatter/gather call.
+ * Returns -1 if a page of the tile is not mapped.
+ */
+static int copy_tile(void *mat, int size, int row, int col, int rows, int cols, unsigned int *tile, bool to_vm)
+{
+    vm_iovec iov[MAT_TILE];
+    for (int r = 0; r < rows; ++r)
     {
-        memcpy(cur_src, cur_pa, size);
-        pthread_mutex_unlock(&general_lock);
-        return;
+        iov[r].va = mat + ((size_t)(row + r) * size + col) * sizeof(int);
+        iov[r].buf = tile + r * MAT_TILE;
+        iov[r].len = cols * sizeof(int);
     }
-    memcpy(cur_src, cur_pa, bytes_to_copy);
-    cur_va += bytes_to_copy;
-    cur_src += bytes_to_copy;
-    remaining_bytes -= bytes_to_copy;
+    if (to_vm)
+        return put_values(iov, rows);
+    return get_values(iov, rows);
+}
 
-    // copy all middle pages
-    while (remaining_bytes >= PGSIZE)
+/*
+ * c += a * b for rows x inner and inner x cols tiles, four columns at a time.
+ * Columns of b past cols only reach columns of c that are not written back.
+ */
+static void multiply_tile(const unsigned int *a, const unsigned int *b, unsigned int *c, int rows, int inner, int cols)
+{
+    int vectors = (cols + 3) / 4;
+    for (int i = 0; i < rows; ++i)
     {
-        cur_pa = translate(cur_va);
-        if (cur_pa == NULL)
+        vec4u *c_row = (vec4u *)(c + i * MAT_TILE);
+        for (int k = 0; k < inner; ++k)
         {
-            fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
-            pthread_mutex_unlock(&general_lock);
-            return;
+            vec4u a_ik = (vec4u){0, 0, 0, 0} + a[i * MAT_TILE + k];
+            const vec4u *b_row = (const vec4u *)(b + k * MAT_TILE);
+            for (int v = 0; v < vectors; ++v)
+            {
+                c_row[v] += a_ik * b_row[v];
+            }
         }
-        memcpy(cur_src, cur_pa, PGSIZE);
-        cur_va += PGSIZE;
-        cur_src += PGSIZE;
-        remaining_bytes -= PGSIZE;
     }
-    if (remaining_bytes > 0)
+}
+
+static void *mat_mult_band(void *arg)
+{
+    struct mat_mult_work *work = arg;
+    int size = work->size;
+    unsigned int a[MAT_TILE * MAT_TILE] __attribute__((aligned(16))) = {0};
+    unsigned int b[MAT_TILE * MAT_TILE] __attribute__((aligned(16))) = {0};
+    unsigned int c[MAT_TILE * MAT_TILE] __attribute__((aligned(16)));
+
+    for (int i = work->first_row; i < work->last_row; i += MAT_TILE)
     {
-        // do last page
-        cur_pa = translate(cur_va);
-        if (cur_pa == NULL)
+        int rows = size - i < MAT_TILE ? size - i : MAT_TILE;
+        for (int j = 0; j < size; j += MAT_TILE)
         {
-            fprintf(stderr, "%s at line %d: the current physical address is NULL\n", __func__, __LINE__);
-            pthread_mutex_unlock(&general_lock);
-            return;
+            int cols = size - j < MAT_TILE ? size - j : MAT_TILE;
+            memset(c, 0, sizeof(c));
+            for (int k = 0; k < size; k += MAT_TILE)
+            {
+                int inner = size - k < MAT_TILE ? size - k : MAT_TILE;
+                if (copy_tile(work->mat1, size, i, k, rows, inner, a, false) != 0 ||
+                    copy_tile(work->mat2, size, k, j, inner, cols, b, false) != 0)
+                {
+                    work->status = -1;
+                    return NULL;
+                }
+                multiply_tile(a, b, c, rows, inner, cols);
+            }
+            if (copy_tile(work->answer, size, i, j, rows, cols, c, true) != 0)
+            {
+                work->status = -1;
+                return NULL;
+            }
         }
-        memcpy(cur_src, cur_pa, remaining_bytes);
     }
-    pthread_mutex_unlock(&general_lock);
+    work->status = 0;
+    return NULL;
 }
 
 /*
-This function receives two matrices mat1 and mat2 as an argument with size
-argument representing the number of rows and columns. After performing matrix
-multiplication, copy the result to answer.
-*/
+ * mat_mult() on num_threads threads, each computing a band of tile rows of
+ * the answer. The threads translate through their own TLBs, without a lock.
+ * Returns -1 if a page of a matrix is not mapped, the answer is then incomplete.
+ */
+int mat_mult_threads(void *mat1, void *mat2, int size, void *answer, int num_threads)
+{
+    int tile_rows = (size + MAT_TILE - 1) / MAT_TILE;
+    if (num_threads > tile_rows)
+        num_threads = tile_rows;
+    if (num_threads < 1)
+        num_threads = 1;
+
+    struct mat_mult_work work[num_threads];
+    pthread_t threads[num_threads];
+    bool started[num_threads];
+    for (int t = 0; t < num_threads; ++t)
+    {
+        work[t].mat1 = mat1;
+        work[t].mat2 = mat2;
+        work[t].answer = answer;
+        work[t].size = size;
+        work[t].first_row = tile_rows * t / num_threads * MAT_TILE;
+        work[t].last_row = tile_rows * (t + 1) / num_threads * MAT_TILE;
+        if (work[t].last_row > size)
+            work[t].last_row = size;
+    }
+    // the calling thread takes the first band
+    for (int t = 1; t < num_threads; ++t)
+    {
+        started[t] = pthread_create(&threads[t], NULL, mat_mult_band, &work[t]) == 0;
+        if (!started[t])
+        {
+            fprintf(stderr, "%s at line %d: failed to create thread, computing its band here\n", __func__, __LINE__);
+            mat_mult_band(&work[t]);
+        }
+    }
+    mat_mult_band(&work[0]);
+    int status = work[0].status;
+    for (int t = 1; t < num_threads; ++t)
+    {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        if (work[t].status != 0)
+            status = -1;
+    }
+    return status;
+}
+
 void mat_mult(void *mat1, void *mat2, int size, void *answer)
 {
 
@@ -582,26 +1355,10 @@ void mat_mult(void *mat1, void *mat2, int size, void *answer)
      * store the result to the "answer array"
      */
 
-    int x, y, val_size = sizeof(int);
-    int i, j, k;
-    for (i = 0; i < size; i++)
+    // tiles of MAT_TILE x MAT_TILE ints are copied out of virtual memory one row
+    // at a time, multiplied in local buffers, and the answer tiles written back.
+    if (mat_mult_threads(mat1, mat2, size, answer, MAT_MULT_THREADS) != 0)
     {
-        for (j = 0; j < size; j++)
-        {
-            unsigned int a, b, c = 0;
-            for (k = 0; k < size; k++)
-            {
-                int address_a = (unsigned int)mat1 + ((i * size * sizeof(int))) + (k * sizeof(int));
-                int address_b = (unsigned int)mat2 + ((k * size * sizeof(int))) + (j * sizeof(int));
-                get_value((void *)address_a, &a, sizeof(int));
-                get_value((void *)address_b, &b, sizeof(int));
-                // printf("Values at the index: %d, %d, %d, %d, %d\n",
-                //     a, b, size, (i * size + k), (k * size + j));
-                c += (a * b);
-            }
-            int address_c = (unsigned int)answer + ((i * size * sizeof(int))) + (j * sizeof(int));
-            // printf("This is the c: %d, address: %x!\n", c, address_c);
-            put_value((void *)address_c, (void *)&c, sizeof(int));
-        }
+        fprintf(stderr, "%s at line %d: a matrix is not mapped in virtual memory\n", __func__, __LINE__);
     }
 }
@@ -5,59 +5,173 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
-// Assume the address space is 32 bits, so the max memory size is 4GB
+// The address space is 32 bits by default, so the max memory size is 4GB
 // Page size is 4KB
 
 // Add any important includes here which you may need
+// Virtual address bits, make ADDRESS_SPACE=48 for 4 levels of page tables in a 64 bit build
+#ifndef ADDRESS_SPACE
 #define ADDRESS_SPACE 32
+#endif
 
 #define PGSIZE 4096
 #define PGSIZE_BITS 12
 
 // Maximum size of virtual memory
-#define MAX_MEMSIZE 4ULL * 1024 * 1024 * 1024
+#define MAX_MEMSIZE (1ULL << ADDRESS_SPACE)
 
 // Size of "physcial memory"
 #define MEMSIZE 1024 * 1024 * 1024
 
+// Map a frame to a page when it is first accessed instead of in t_malloc: make DEMAND_PAGING=1
+#ifndef DEMAND_PAGING
+#define DEMAND_PAGING 0
+#endif
+
+// Evict pages to a swap file when physical memory is full: make SWAP=1
+#ifndef SWAP
+#define SWAP 0
+#endif
+#ifndef SWAP_FILE
+#define SWAP_FILE "my_vm.swap"
+#endif
+// Pages the swap file holds, a swap slot is kept in page_frame_index
+#ifndef SWAP_PAGES
+#define SWAP_PAGES (MEMSIZE / PGSIZE)
+#endif
+_Static_assert(SWAP_PAGES <= (1UL << (32 - PGSIZE_BITS)), "SWAP_PAGES must fit in page_frame_index");
+
+// TLB geometry, can be set at build time: make TLB_ENTRIES=1024 TLB_WAYS=8
+#ifndef TLB_ENTRIES
 #define TLB_ENTRIES 512
+#endif
+#ifndef TLB_WAYS
+#define TLB_WAYS 4
+#endif
+#define TLB_SETS (TLB_ENTRIES / TLB_WAYS)
+
+_Static_assert((TLB_WAYS & (TLB_WAYS - 1)) == 0 && TLB_WAYS <= 32, "TLB_WAYS must be a power of two up to 32");
+_Static_assert(TLB_ENTRIES % TLB_WAYS == 0, "TLB_ENTRIES must be a multiple of TLB_WAYS");
 
 // Structure to represents TLB
 struct tlb
 {
-    /*Assume your TLB is a direct mapped TLB with number of entries as TLB_ENTRIES
-     * Think about the size of each TLB entry that performs virtual to physical
-     * address translation.
+    /* TLB_WAYS-way set associative TLB with TLB_ENTRIES entries.
+     * A virtual page number selects the set (tag % TLB_SETS) and is compared
+     * against every way of that set. Each entry caches the physical address
+     * of the page frame, the offset is added on a hit.
+     */
+    struct tlb_set
+    {
+        struct
+        {
+            unsigned long tag;
+            unsigned long physical_address;
+            bool valid;
+        } entries[TLB_WAYS];
+        unsigned long plru; // tree pseudo-LRU bits, node n at bit n (1 = victim is in the right half)
+    } sets[TLB_SETS];
+};
+
+// L1 micro-TLB in front of the TLB, make MICRO_TLB_ENTRIES=16
+#ifndef MICRO_TLB_ENTRIES
+#define MICRO_TLB_ENTRIES 8
+#endif
+
+// Structure to represents the micro-TLB
+struct micro_tlb
+{
+    /* Small fully associative TLB, probed before the set associative one.
+     * Filled from the TLB on a hit there, replaced round-robin.
+     */
+    struct
+    {
+        unsigned long tag;
+        unsigned long physical_address;
+        bool valid;
+    } entries[MICRO_TLB_ENTRIES];
+    int next; // entry replaced by the next fill
+};
+
+// L3 TLB of large page translations, make HUGE_TLB_ENTRIES=32
+#ifndef HUGE_TLB_ENTRIES
+#define HUGE_TLB_ENTRIES 16
+#endif
+
+// Structure to represents the large page TLB
+struct huge_tlb
+{
+    /* Fully associative, probed when both TLBs miss. An entry maps
+     * HUGE_PAGE_FRAMES pages, the tag is the virtual large page number.
+     * Replaced round-robin.
      */
     struct
     {
         unsigned long tag;
         unsigned long physical_address;
         bool valid;
-    } entries[TLB_ENTRIES];
+    } entries[HUGE_TLB_ENTRIES];
+    int next; // entry replaced by the next fill
 };
 
 typedef struct page_dir_entry
 {
-    unsigned int page_index_of_page_table : 32 - PGSIZE_BITS;
+    unsigned int page_index_of_page_table : 32 - PGSIZE_BITS; // first frame of the large page if huge
     unsigned int allocated_page : 1;
+    unsigned int huge : 1; // maps a large page directly, there is no page table
 } page_dir_entry;
 typedef struct page_table_entry
 {
-    unsigned int page_frame_index : 32 - PGSIZE_BITS;
+    unsigned int page_frame_index : 32 - PGSIZE_BITS; // swap slot while swapped
     unsigned int allocated_page : 1;
+    unsigned int accessed : 1; // set by a page walk, cleared by the clock
+    unsigned int swapped : 1;  // the page is in the swap file, not in a frame
 } page_table_entry;
 
+// Every table takes one page of 4 byte entries and resolves LEVEL_BITS bits
+// of the virtual page number, the top level the bits left over.
+#define LEVEL_BITS (PGSIZE_BITS - 2)
+#define PAGE_TABLE_LEVELS ((ADDRESS_SPACE - PGSIZE_BITS + LEVEL_BITS - 1) / LEVEL_BITS)
+
+_Static_assert(sizeof(page_dir_entry) == 4 && sizeof(page_table_entry) == 4, "table entries must take 4 bytes");
+_Static_assert(PAGE_TABLE_LEVELS >= 2, "ADDRESS_SPACE must leave a page directory above the page tables");
+_Static_assert(ADDRESS_SPACE <= sizeof(void *) * 8, "ADDRESS_SPACE does not fit in a pointer, build for 64 bits");
+
+// A large page is the memory one page table maps: 4MB with 4KB pages
+#define HUGE_PAGE_FRAMES (PGSIZE / sizeof(page_table_entry))
+#define HUGE_PGSIZE (HUGE_PAGE_FRAMES * PGSIZE)
+
+// mat_mult() works on square tiles of MAT_TILE ints, on MAT_MULT_THREADS threads: make MAT_MULT_THREADS=4
+#ifndef MAT_TILE
+#define MAT_TILE 64
+#endif
+#ifndef MAT_MULT_THREADS
+#define MAT_MULT_THREADS 1
+#endif
+
+// One range of a vectored transfer: len bytes at virtual address va, from or to buf
+typedef struct vm_iovec
+{
+    void *va;
+    void *buf;
+    size_t len;
+} vm_iovec;
+
 void set_physical_mem();
 void *translate(void *va);
 int page_map(void *va, void *pa);
-bool check_in_tlb(void *va);
-void put_in_tlb(void *va, void *pa);
 void *t_malloc(unsigned int num_bytes);
 void t_free(void *va, int size);
+void *t_malloc_pages(unsigned int num_pages);
+void *t_malloc_huge(unsigned int num_bytes);
+void t_free_pages(void *va, unsigned int num_pages);
 int put_value(void *va, void *val, int size);
 void get_value(void *va, void *val, int size);
+int put_values(const vm_iovec *iov, int iovcnt);
+int get_values(const vm_iovec *iov, int iovcnt);
+int vm_copy(void *va_dst, void *va_src, size_t n);
 void mat_mult(void *mat1, void *mat2, int size, void *answer);
+int mat_mult_threads(void *mat1, void *mat2, int size, void *answer, int num_threads);
 void print_TLB_missrate();
 void *get_next_avail(int num_pages);
 
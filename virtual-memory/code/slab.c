@@ -0,0 +1,264 @@
+#include "slab.h"
+#include <pthread.h>
+
+/*
+ * Every thread allocates each size class from a slab it owns, without a lock:
+ * only the owner clears bits of free_map, other threads only set them, both
+ * with atomic operations. slab_lock covers everything else: the partial
+ * lists, the page to slab hash, ownership changes and slabs without owner.
+ */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static slab *partial_slabs[SLAB_CLASSES]; // Slabs without owner that have free objects
+static slab *slab_hash[SLAB_HASH_SIZE];
+
+// Slab each thread allocates from, per size class
+static __thread slab *thread_slabs[SLAB_CLASSES];
+static __thread bool thread_slabs_registered;
+static pthread_key_t thread_slabs_key;
+static pthread_once_t thread_slabs_once = PTHREAD_ONCE_INIT;
+
+static int size_class(unsigned int num_bytes)
+{
+    int class = 0;
+    while ((SLAB_MIN_SIZE << class) < num_bytes)
+    {
+        class++;
+    }
+    return class;
+}
+
+static size_t object_size(slab *s)
+{
+    return SLAB_MIN_SIZE << s->size_class;
+}
+
+static slab **hash_bucket(void *va)
+{
+    return &slab_hash[((size_t)va / PGSIZE) % SLAB_HASH_SIZE];
+}
+
+/*
+ * The slab holding va, NULL if its page is not a slab. The caller holds slab_lock.
+ */
+static slab *find_slab(void *va)
+{
+    void *page = (void *)((size_t)va & ~(size_t)(PGSIZE - 1));
+    for (slab *s = *hash_bucket(va); s != NULL; s = s->next_hash)
+    {
+        if (s->va == page)
+        {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void push_partial(slab *s)
+{
+    slab *head = partial_slabs[s->size_class];
+    s->prev_partial = NULL;
+    s->next_partial = head;
+    if (head != NULL)
+        head->prev_partial = s;
+    partial_slabs[s->size_class] = s;
+    s->partial = true;
+}
+
+static void remove_partial(slab *s)
+{
+    if (s->prev_partial != NULL)
+        s->prev_partial->next_partial = s->next_partial;
+    else
+        partial_slabs[s->size_class] = s->next_partial;
+    if (s->next_partial != NULL)
+        s->next_partial->prev_partial = s->prev_partial;
+    s->partial = false;
+}
+
+static slab *new_slab(int class)
+{
+    void *va = t_malloc_pages(1);
+    if (va == NULL)
+    {
+        return NULL;
+    }
+    slab *s = calloc(1, sizeof(slab));
+    if (s == NULL)
+    {
+        fprintf(stderr, "%s at line %d: failed to allocate slab.\n", __func__, __LINE__);
+        exit(1);
+    }
+    s->va = va;
+    s->size_class = class;
+    s->num_objects = PGSIZE / object_size(s);
+    s->free_objects = s->num_objects;
+    for (int i = 0; i < s->num_objects; ++i)
+    {
+        s->free_map[i / 64] |= 1ULL << (i % 64);
+    }
+
+    slab **bucket = hash_bucket(va);
+    s->next_hash = *bucket;
+    *bucket = s;
+    return s;
+}
+
+/*
+ * Give the page of an empty slab back to t_free. The caller holds slab_lock.
+ */
+static void release_slab(slab *s)
+{
+    slab **link = hash_bucket(s->va);
+    while (*link != s)
+    {
+        link = &(*link)->next_hash;
+    }
+    *link = s->next_hash;
+    t_free_pages(s->va, 1);
+    free(s);
+}
+
+/*
+ * Drop the ownership of a slab. The caller holds slab_lock.
+ */
+static void detach_slab(slab *s)
+{
+    s->owner = NULL;
+    if (s->free_objects == s->num_objects)
+    {
+        release_slab(s);
+    }
+    else if (s->free_objects > 0)
+    {
+        push_partial(s);
+    }
+    // a full slab joins the partial list when one of its objects is freed.
+}
+
+static void detach_thread_slabs(void *unused)
+{
+    pthread_mutex_lock(&slab_lock);
+    for (int class = 0; class < SLAB_CLASSES; ++class)
+    {
+        if (thread_slabs[class] != NULL)
+        {
+            detach_slab(thread_slabs[class]);
+            thread_slabs[class] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+
+static void create_thread_slabs_key()
+{
+    pthread_key_create(&thread_slabs_key, detach_thread_slabs);
+}
+
+/*
+ * Take the lowest free object of a slab owned by this thread. NULL if it is full.
+ */
+static void *claim_object(slab *s)
+{
+    for (int i = 0; i * 64 < s->num_objects; ++i)
+    {
+        uint64_t word = __atomic_load_n(&s->free_map[i], __ATOMIC_ACQUIRE);
+        if (word != 0)
+        {
+            int bit = __builtin_ctzll(word);
+            __atomic_fetch_and(&s->free_map[i], ~(1ULL << bit), __ATOMIC_ACQ_REL);
+            __atomic_sub_fetch(&s->free_objects, 1, __ATOMIC_ACQ_REL);
+            return s->va + (i * 64 + bit) * object_size(s);
+        }
+    }
+    return NULL;
+}
+
+static void release_object(slab *s, void *va)
+{
+    size_t index = (size_t)(va - s->va) / object_size(s);
+    __atomic_fetch_or(&s->free_map[index / 64], 1ULL << (index % 64), __ATOMIC_ACQ_REL);
+    __atomic_add_fetch(&s->free_objects, 1, __ATOMIC_ACQ_REL);
+}
+
+void *slab_malloc(unsigned int num_bytes)
+{
+    int class = size_class(num_bytes);
+    slab *s = thread_slabs[class];
+    if (s != NULL)
+    {
+        void *va = claim_object(s);
+        if (va != NULL)
+        {
+            return va;
+        }
+    }
+
+    // the slab of this thread is full: swap it for a partial slab or a new page.
+    pthread_mutex_lock(&slab_lock);
+    if (s != NULL)
+    {
+        detach_slab(s);
+    }
+    if (!thread_slabs_registered)
+    {
+        // the destructor only runs for a non NULL value
+        pthread_once(&thread_slabs_once, create_thread_slabs_key);
+        pthread_setspecific(thread_slabs_key, thread_slabs);
+        thread_slabs_registered = true;
+    }
+    s = partial_slabs[class];
+    if (s != NULL)
+    {
+        remove_partial(s);
+    }
+    else
+    {
+        s = new_slab(class);
+    }
+    thread_slabs[class] = s;
+    if (s == NULL)
+    {
+        pthread_mutex_unlock(&slab_lock);
+        return NULL;
+    }
+    s->owner = thread_slabs;
+    pthread_mutex_unlock(&slab_lock);
+    return claim_object(s);
+}
+
+void slab_free(void *va, unsigned int num_bytes)
+{
+    // an object of the slab this thread allocates from needs no lock.
+    slab *s = thread_slabs[size_class(num_bytes)];
+    if (s != NULL && va >= s->va && va < s->va + PGSIZE)
+    {
+        release_object(s, va);
+        return;
+    }
+
+    pthread_mutex_lock(&slab_lock);
+    s = find_slab(va);
+    if (s == NULL)
+    {
+        fprintf(stderr, "%s at line %d: %p was not allocated by t_malloc\n", __func__, __LINE__, va);
+        pthread_mutex_unlock(&slab_lock);
+        return;
+    }
+    release_object(s, va);
+    if (s->owner == NULL)
+    {
+        if (s->free_objects == s->num_objects)
+        {
+            if (s->partial)
+            {
+                remove_partial(s);
+            }
+            release_slab(s);
+        }
+        else if (!s->partial)
+        {
+            push_partial(s);
+        }
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
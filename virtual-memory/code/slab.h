@@ -0,0 +1,34 @@
+#ifndef SLAB_H_INCLUDED
+#define SLAB_H_INCLUDED
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "my_vm.h"
+
+// Size classes are the powers of two from SLAB_MIN_SIZE to SLAB_MAX_SIZE bytes,
+// larger requests get whole pages.
+#define SLAB_MIN_SIZE 8
+#define SLAB_MAX_SIZE 2048
+#define SLAB_CLASSES 9
+#define SLAB_HASH_SIZE 4096
+
+// One page of virtual memory cut into objects of one size class.
+typedef struct slab
+{
+    void *va;              // Virtual address of the page
+    int size_class;        // Index of the size class, object size is SLAB_MIN_SIZE << size_class
+    int num_objects;       // Objects in the page
+    volatile int free_objects;
+    uint64_t free_map[(PGSIZE / SLAB_MIN_SIZE + 63) / 64]; // Bit i is set while object i is free
+
+    void *owner;           // Per-thread slabs of the thread allocating from this slab, NULL if none
+    bool partial;          // Linked in the partial list of its size class
+    struct slab *next_partial;
+    struct slab *prev_partial;
+    struct slab *next_hash; // Next slab in the same bucket of the page to slab hash
+} slab;
+
+void *slab_malloc(unsigned int num_bytes);
+void slab_free(void *va, unsigned int num_bytes);
+#endif